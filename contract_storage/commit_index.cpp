@@ -0,0 +1,85 @@
+#include <contract_storage/commit_index.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		ContractCommitIndex::ContractCommitIndex()
+			: _pruned_seq(0)
+		{
+		}
+
+		void ContractCommitIndex::clear()
+		{
+			_by_commit_id.clear();
+			_by_seq.clear();
+			_pruned_seq = 0;
+		}
+
+		void ContractCommitIndex::add(const ContractCommitInfo& commit_info)
+		{
+			erase_pruned();
+			_by_commit_id[commit_info.commit_id] = commit_info;
+			_by_seq[commit_info.id] = commit_info.commit_id;
+		}
+
+		void ContractCommitIndex::remove_after(uint64_t commit_seq)
+		{
+			auto it = _by_seq.upper_bound(commit_seq);
+			while (it != _by_seq.end())
+			{
+				_by_commit_id.erase(it->second);
+				it = _by_seq.erase(it);
+			}
+		}
+
+		void ContractCommitIndex::mark_pruned(uint64_t commit_seq)
+		{
+			auto pruned_seq = _pruned_seq.load();
+			while (pruned_seq < commit_seq && !_pruned_seq.compare_exchange_weak(pruned_seq, commit_seq))
+				;
+		}
+
+		void ContractCommitIndex::erase_pruned()
+		{
+			auto pruned_seq = _pruned_seq.load();
+			while (!_by_seq.empty() && _by_seq.begin()->first <= pruned_seq)
+			{
+				_by_commit_id.erase(_by_seq.begin()->second);
+				_by_seq.erase(_by_seq.begin());
+			}
+		}
+
+		const ContractCommitInfo* ContractCommitIndex::find(const ContractCommitId& commit_id) const
+		{
+			auto it = _by_commit_id.find(commit_id);
+			if (it == _by_commit_id.end() || it->second.id <= _pruned_seq.load())
+				return nullptr;
+			return &it->second;
+		}
+
+		const ContractCommitInfo* ContractCommitIndex::find_seq(uint64_t commit_seq) const
+		{
+			auto it = _by_seq.find(commit_seq);
+			if (it == _by_seq.end() || commit_seq <= _pruned_seq.load())
+				return nullptr;
+			return &_by_commit_id.find(it->second)->second;
+		}
+
+		const ContractCommitInfo* ContractCommitIndex::top() const
+		{
+			if (_by_seq.empty() || _by_seq.rbegin()->first <= _pruned_seq.load())
+				return nullptr;
+			return &_by_commit_id.find(_by_seq.rbegin()->second)->second;
+		}
+
+		std::vector<ContractCommitInfo> ContractCommitIndex::after(uint64_t commit_seq) const
+		{
+			auto pruned_seq = _pruned_seq.load();
+			std::vector<ContractCommitInfo> commit_infos;
+			for (auto it = _by_seq.rbegin(); it != _by_seq.rend() && it->first > commit_seq && it->first > pruned_seq; it++)
+				commit_infos.push_back(_by_commit_id.find(it->second)->second);
+			return commit_infos;
+		}
+	}
+}
@@ -8,7 +8,7 @@
 #include <fcrypto/sha256.hpp>
 #include <boost/uuid/sha1.hpp>
 #include <memory>
-#include <list>
+#include <algorithm>
 
 namespace contract
 {
@@ -168,39 +168,57 @@ namespace contract
 		}
 
 
-		// parse arg to json_array when it's json object. otherwhile return itself. And recursively process child elements
-		static jsondiff::JsonValue nested_json_object_to_array(const jsondiff::JsonValue& json_value)
+		typedef std::vector<std::pair<const std::string*, const jsondiff::JsonValue*>> OrderedJsonKeysBuffer;
+
+		// hash same bytes as json_dumps of the value with every object turned to array of [key, value] sorted by key.
+		// nested objects sort their keys in the tail of the shared buffer, no json is copied
+		static void write_ordered_json(fcrypto::sha256::encoder& enc, const jsondiff::JsonValue& json_value, OrderedJsonKeysBuffer& keys_buffer)
 		{
 			if (json_value.is_object())
 			{
-				const auto& obj = json_value.as<jsondiff::JsonObject>();
-				jsondiff::JsonArray json_array;
-				std::list<std::string> keys;
+				const auto& obj = json_value.get_object();
+				auto begin = keys_buffer.size();
 				for (auto it = obj.begin(); it != obj.end(); it++)
 				{
-					keys.push_back(it->key());
+					keys_buffer.push_back(std::make_pair(&it->key(), &it->value()));
 				}
-				keys.sort(&compare_key);
-				for (const auto& key : keys)
+				auto end = keys_buffer.size();
+				std::stable_sort(keys_buffer.begin() + begin, keys_buffer.end(), [](const OrderedJsonKeysBuffer::value_type& a, const OrderedJsonKeysBuffer::value_type& b) {
+					return compare_key(*a.first, *b.first);
+				});
+				enc.put('[');
+				for (auto i = begin; i < end; i++)
 				{
-					jsondiff::JsonArray item_json;
-					item_json.push_back(key);
-					item_json.push_back(nested_json_object_to_array(obj[key]));
-					json_array.push_back(item_json);
+					if (i > begin)
+						enc.put(',');
+					enc.put('[');
+					const auto& dumped_key = json_dumps(*keys_buffer[i].first);
+					enc.write(dumped_key.c_str(), (uint32_t)dumped_key.size());
+					enc.put(',');
+					// copy the pointer, the buffer may grow when writing the value
+					auto value = keys_buffer[i].second;
+					write_ordered_json(enc, *value, keys_buffer);
+					enc.put(']');
 				}
-				return json_array;
+				enc.put(']');
+				keys_buffer.resize(begin);
+				return;
 			}
 			if (json_value.is_array())
 			{
-				const auto& arr = json_value.as<jsondiff::JsonArray>();
-				jsondiff::JsonArray result;
-				for (const auto& item : arr)
+				const auto& arr = json_value.get_array();
+				enc.put('[');
+				for (size_t i = 0; i < arr.size(); i++)
 				{
-					result.push_back(nested_json_object_to_array(item));
+					if (i > 0)
+						enc.put(',');
+					write_ordered_json(enc, arr[i], keys_buffer);
 				}
-				return result;
+				enc.put(']');
+				return;
 			}
-			return json_value;
+			const auto& dumped = json_dumps(json_value);
+			enc.write(dumped.c_str(), (uint32_t)dumped.size());
 		}
 
 		static void sha256(char *string, char outputBuffer[65])
@@ -220,9 +238,10 @@ namespace contract
 
 		fcrypto::sha256 ordered_json_digest(const jsondiff::JsonValue& json_value)
 		{
-			const auto& parsed_json = nested_json_object_to_array(json_value);
-			const auto& dumped = json_dumps(parsed_json);
-			return fcrypto::sha256::hash(dumped);
+			fcrypto::sha256::encoder enc;
+			OrderedJsonKeysBuffer keys_buffer;
+			write_ordered_json(enc, json_value, keys_buffer);
+			return enc.result();
 		}
 	}
 }
\ No newline at end of file
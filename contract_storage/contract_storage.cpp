@@ -1,6 +1,13 @@
 #include <contract_storage/contract_storage.hpp>
 #include <contract_storage/config.hpp>
 #include <contract_storage/exceptions.hpp>
+#include <contract_storage/undo_log.hpp>
+#include <contract_storage/state_tree.hpp>
+#include <contract_storage/state_set_hash.hpp>
+#include <contract_storage/event_log.hpp>
+#include <contract_storage/event_bloom.hpp>
+#include <contract_storage/subscription.hpp>
+#include <contract_storage/commit_index.hpp>
 #include <fjson/io/json.hpp>
 #include <fjson/string.hpp>
 #include <fjson/crypto/base64.hpp>
@@ -11,6 +18,10 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 // TODO: use a single embedded document database to store all data
 
@@ -22,17 +33,30 @@ namespace contract
 
 		static const std::string root_state_hash_key = "ROOT_STATE_HASH";
 		static const std::string top_root_state_hash_key = "TOP_ROOT_STATE_HASH";
+		// exists when state tree nodes match the state
+		static const std::string state_tree_built_key = "STATE_TREE_BUILT";
+		// multiset hash of state keys
+		static const std::string state_set_hash_key = "STATE_SET_HASH";
+		// exists when commit ids of the db are saved as raw bytes
+		static const std::string commit_id_format_key = "COMMIT_ID_FORMAT";
+		static const std::string binary_commit_id_format = "binary";
+		static const size_t commit_id_bytes_size = 32;
+		static const std::string contract_info_key_prefix = "contract_info_key_";
+		static const std::string contract_storage_key_prefix = "contract_storage_key_";
+		static const std::string contract_name_id_mapping_key_prefix = "contract_name_id_mapping_";
 
 		static std::recursive_mutex storage_mutex;
 
+		static const std::chrono::seconds prune_poll_interval(1);
+
 		static std::string make_contract_info_key(const std::string& contract_id)
 		{
-			return std::string("contract_info_key_") + contract_id;
+			return contract_info_key_prefix + contract_id;
 		}
 
 		static std::string make_contract_storage_key(const std::string& contract_id, const std::string &storage_name)
 		{
-			return std::string("contract_storage_key_") + contract_id + "_" + storage_name;
+			return contract_storage_key_prefix + contract_id + "_" + storage_name;
 		}
 
 		static std::string make_commit_events_key(const ContractCommitId& commit_id) {
@@ -45,7 +69,125 @@ namespace contract
 
 		static std::string make_contract_name_id_mapping_key(const std::string& contract_name)
 		{
-			return std::string("contract_name_id_mapping_") + contract_name;
+			return contract_name_id_mapping_key_prefix + contract_name;
+		}
+
+		// leaves of state tree
+		static bool is_state_tree_leaf_key(const std::string& key)
+		{
+			return boost::starts_with(key, contract_info_key_prefix) || boost::starts_with(key, contract_storage_key_prefix);
+		}
+
+		// keys in state set hash
+		static bool is_state_set_key(const std::string& key)
+		{
+			return is_state_tree_leaf_key(key) || boost::starts_with(key, contract_name_id_mapping_key_prefix);
+		}
+
+		static void add_changed_state_key(ContractCommitNotification& notification, const std::string& key)
+		{
+			notification.changed_keys.push_back(key);
+			// contract ids are addresses without '_'
+			if (boost::starts_with(key, contract_info_key_prefix))
+				notification.changed_contracts.insert(key.substr(contract_info_key_prefix.size()));
+			else if (boost::starts_with(key, contract_storage_key_prefix))
+				notification.changed_contracts.insert(key.substr(contract_storage_key_prefix.size(), key.find('_', contract_storage_key_prefix.size()) - contract_storage_key_prefix.size()));
+		}
+
+		// notification of the state keys actually changed by writes
+		static std::shared_ptr<ContractCommitNotification> make_commit_notification(const ContractWriteSet& writes)
+		{
+			auto notification = std::make_shared<ContractCommitNotification>();
+			for (const auto& p : writes.items())
+			{
+				const auto& item = p.second;
+				if (!is_state_set_key(p.first) || (item.deleted ? !item.existed : (item.existed && item.value == item.old_value)))
+					continue;
+				add_changed_state_key(*notification, p.first);
+			}
+			return notification;
+		}
+
+		static std::string state_tree_root(ContractWriteSet& writes)
+		{
+			std::string built;
+			if (!writes.get(state_tree_built_key, &built))
+				return "";
+			return ContractStateTree(writes).root().str();
+		}
+
+		static std::string make_commit_undo_key(const std::string& saved_commit_id)
+		{
+			return std::string("commit_undo$") + saved_commit_id;
+		}
+
+		// save pre-images of keys changed by the commit. root state hashes, commit id format and the commit's own records are not state to restore
+		static void add_commit_undo_record(ContractWriteSet& writes, const std::string& saved_commit_id)
+		{
+			std::vector<ContractUndoItem> undo_items;
+			for (const auto& p : writes.items())
+			{
+				if (p.first == root_state_hash_key || p.first == top_root_state_hash_key || p.first == commit_id_format_key || p.first == saved_commit_id)
+					continue;
+				ContractUndoItem item;
+				item.key = p.first;
+				item.existed = p.second.existed;
+				item.value = p.second.old_value;
+				undo_items.push_back(item);
+			}
+			writes.put(make_commit_undo_key(saved_commit_id), encode_undo_items(undo_items));
+		}
+
+		static bool hex_to_bytes(const std::string& hex, std::string* bytes)
+		{
+			if (hex.size() % 2)
+				return false;
+			bytes->clear();
+			for (size_t i = 0; i < hex.size(); i += 2)
+			{
+				int value = 0;
+				for (size_t j = i; j < i + 2; j++)
+				{
+					auto c = hex[j];
+					if (c >= '0' && c <= '9')
+						value = value * 16 + (c - '0');
+					else if (c >= 'a' && c <= 'f')
+						value = value * 16 + (c - 'a' + 10);
+					else if (c >= 'A' && c <= 'F')
+						value = value * 16 + (c - 'A' + 10);
+					else
+						return false;
+				}
+				bytes->push_back((char)value);
+			}
+			return true;
+		}
+
+		static std::string bytes_to_hex(const std::string& bytes)
+		{
+			static const char* hex_chars = "0123456789abcdef";
+			std::string hex;
+			hex.reserve(bytes.size() * 2);
+			for (auto c : bytes)
+			{
+				hex.push_back(hex_chars[((unsigned char)c) >> 4]);
+				hex.push_back(hex_chars[((unsigned char)c) & 0xf]);
+			}
+			return hex;
+		}
+
+		// the format is a parameter for threads which can't read the service's format
+		static std::string saved_commit_id_of_format(const ContractCommitId& commit_id, bool binary_commit_ids)
+		{
+			std::string bytes;
+			if (!binary_commit_ids || commit_id.size() != 2 * commit_id_bytes_size || !hex_to_bytes(commit_id, &bytes))
+				return commit_id;
+			return bytes;
+		}
+
+		static std::string commit_id_sql_column_of_format(bool binary_commit_ids)
+		{
+			return binary_commit_ids ? "lower(hex(commit_id)) as commit_id" : "commit_id";
 		}
 
 		ContractStorageService::ContractStorageService(uint32_t magic_number, const std::string& storage_db_path, const std::string& storage_sql_db_path, bool auto_open)
@@ -79,17 +221,33 @@ namespace contract
 				auto status = leveldb::DB::Open(options, _storage_db_path, &_db);
 				assert(status.ok());
 			}
+			// the commit id format decides how commit_info is read
+			load_commit_id_format();
 			if (!_sql_db)
 			{
 				auto status = sqlite3_open(_storage_sql_db_path.c_str(), &_sql_db);
 				assert(status == SQLITE_OK);
+				apply_sqlite_options(_sql_db, _options.sqlite);
 				// init tables
 				this->init_commits_table();
+				this->init_checkpoints_table();
+				this->init_finalized_table();
+				load_commit_index();
+				// continue pruning left by last run
+				if (_options.background_pruning && finalized_commit_seq() > 0)
+					start_background_pruning();
 			}
+			load_root_state_hashes();
 		}
 
 		void ContractStorageService::close()
 		{
+			stop_background_pruning();
+			wait_background_checkpoint();
+			_commit_id_format_loaded = false;
+			_commit_index.clear();
+			_saved_root_state_hash.clear();
+			_saved_top_root_state_hash.clear();
 			if (_db)
 			{
 				delete _db;
@@ -107,21 +265,89 @@ namespace contract
 			return _db ? true : false;
 		}
 
+		void ContractStorageService::set_options(const ContractStorageOptions& options)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_prune_mutex);
+				_prune_options = options;
+			}
+			_options = options;
+			if (_sql_db)
+				apply_sqlite_options(_sql_db, _options.sqlite);
+		}
+
 		static int empty_sql_callback(void *notUsed, int argc, char **argv, char **colNames)
 		{
 			return 0;
 		}
 
+		static int query_records_sql_callback(void *json_array_ptr, int argc, char **argv, char **colNames);
+		static void exec_sql(sqlite3* sql_db, const std::string& sql, jsondiff::JsonArray* records = nullptr);
+		// run a prepared statement with a commit seq bound to its ?1
+		static void exec_sql_with_seq(sqlite3* sql_db, const char* sql, uint64_t commit_seq);
+
+		void ContractStorageService::apply_sqlite_options(sqlite3* sql_db, const ContractSqliteOptions& options)
+		{
+			static const std::set<std::string> journal_modes = { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF" };
+			static const std::set<std::string> synchronous_levels = { "OFF", "NORMAL", "FULL", "EXTRA" };
+			const auto& journal_mode = boost::to_upper_copy(options.journal_mode);
+			const auto& synchronous = boost::to_upper_copy(options.synchronous);
+			if (journal_modes.find(journal_mode) == journal_modes.end())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("invalid sqlite journal mode ") + options.journal_mode));
+			if (synchronous_levels.find(synchronous) == synchronous_levels.end())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("invalid sqlite synchronous ") + options.synchronous));
+			sqlite3_busy_timeout(sql_db, options.busy_timeout_ms);
+			// journal mode is saved in the db file, the others only last for the connection
+			exec_sql(sql_db, "PRAGMA journal_mode=" + journal_mode);
+			exec_sql(sql_db, "PRAGMA synchronous=" + synchronous);
+			exec_sql(sql_db, "PRAGMA cache_size=" + std::to_string(options.cache_size));
+			exec_sql(sql_db, "PRAGMA mmap_size=" + std::to_string(options.mmap_size));
+		}
+
 		void ContractStorageService::init_commits_table()
 		{
 			char *errMsg;
-			auto status = sqlite3_exec(_sql_db, "CREATE TABLE IF NOT EXISTS commit_info (id INTEGER PRIMARY KEY, commit_id varchar(255) not null, change_type varchar(50) not null, contract_id varchar(255))",
+			auto status = sqlite3_exec(_sql_db, "CREATE TABLE IF NOT EXISTS commit_info (id INTEGER PRIMARY KEY, commit_id varchar(255) not null, change_type varchar(50) not null, contract_id varchar(255), block_height INTEGER not null default 0, state_root varchar(64) not null default '', keys_written INTEGER not null default 0, diff_size INTEGER not null default 0)",
 				&empty_sql_callback, nullptr, &errMsg);
 			if (status != SQLITE_OK)
 			{
 				sqlite3_free(errMsg);
 				BOOST_THROW_EXCEPTION(ContractStorageException(errMsg));
 			}
+			// commit_info created by older versions misses the later columns
+			jsondiff::JsonArray columns;
+			status = sqlite3_exec(_sql_db, "PRAGMA table_info(commit_info)", &query_records_sql_callback, &columns, &errMsg);
+			if (status != SQLITE_OK)
+			{
+				std::string err_msg_str(errMsg);
+				sqlite3_free(errMsg);
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+			}
+			std::set<std::string> column_names;
+			for (const auto& column : columns)
+			{
+				column_names.insert(column["name"].as_string());
+			}
+			std::vector<std::pair<std::string, std::string>> added_columns = {
+				// rows saved before block heights were recorded keep a null height
+				{ "block_height", "block_height INTEGER" },
+				{ "state_root", "state_root varchar(64) not null default ''" },
+				{ "keys_written", "keys_written INTEGER not null default 0" },
+				{ "diff_size", "diff_size INTEGER not null default 0" }
+			};
+			for (const auto& column : added_columns)
+			{
+				if (column_names.find(column.first) != column_names.end())
+					continue;
+				status = sqlite3_exec(_sql_db, (std::string("ALTER TABLE commit_info ADD COLUMN ") + column.second).c_str(),
+					&empty_sql_callback, nullptr, &errMsg);
+				if (status != SQLITE_OK)
+				{
+					std::string err_msg_str(errMsg);
+					sqlite3_free(errMsg);
+					BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				}
+			}
 			status = sqlite3_exec(_sql_db, "CREATE INDEX IF NOT EXISTS commit_id_key ON commit_info (commit_id)",
 				&empty_sql_callback, nullptr, &errMsg);
 			if (status != SQLITE_OK)
@@ -129,6 +355,24 @@ namespace contract
 				sqlite3_free(errMsg);
 				BOOST_THROW_EXCEPTION(ContractStorageException(errMsg));
 			}
+			exec_sql(_sql_db, "CREATE INDEX IF NOT EXISTS commit_block_height_key ON commit_info (block_height)");
+			exec_sql(_sql_db, "CREATE INDEX IF NOT EXISTS commit_contract_id_key ON commit_info (contract_id)");
+			// contracts changed by each commit, storage change commits change many contracts
+			exec_sql(_sql_db, "CREATE TABLE IF NOT EXISTS commit_contracts (contract_id varchar(255) not null, commit_seq INTEGER not null, PRIMARY KEY (contract_id, commit_seq))");
+			exec_sql(_sql_db, "CREATE INDEX IF NOT EXISTS commit_contracts_seq_key ON commit_contracts (commit_seq)");
+		}
+
+		void ContractStorageService::init_checkpoints_table()
+		{
+			char *errMsg;
+			auto status = sqlite3_exec(_sql_db, "CREATE TABLE IF NOT EXISTS commit_checkpoint (id INTEGER PRIMARY KEY, commit_seq INTEGER not null, commit_id varchar(255) not null, block_height INTEGER not null, keys_count INTEGER not null, path varchar(1024) not null)",
+				&empty_sql_callback, nullptr, &errMsg);
+			if (status != SQLITE_OK)
+			{
+				std::string err_msg_str(errMsg);
+				sqlite3_free(errMsg);
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+			}
 		}
 
 		static int query_records_sql_callback(void *json_array_ptr, int argc, char **argv, char **colNames)
@@ -150,29 +394,21 @@ namespace contract
 		ContractCommitInfoP ContractStorageService::get_commit_info(const ContractCommitId& commit_id) const
 		{
 			check_db();
-			char *errMsg;
-			jsondiff::JsonArray records;
-			auto query_sql = std::string("select id, commit_id, change_type, contract_id from commit_info where commit_id='") + commit_id + "'";
-			auto status = sqlite3_exec(_sql_db, query_sql.c_str(),
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
-			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
-			}
-			if (records.empty())
+			auto found = _commit_index.find(commit_id);
+			if (!found)
 				return nullptr;
-			jsondiff::JsonObject found_record = records[0].as<jsondiff::JsonObject>();
-			auto commit_info = std::make_shared<ContractCommitInfo>();
-			commit_info->id = found_record["id"].as_uint64();
-			commit_info->commit_id = found_record["commit_id"].as_string();
-			commit_info->contract_id = found_record["contract_id"].as_string();
-			commit_info->change_type = found_record["change_type"].as_string();
-			return commit_info;
+			return std::make_shared<ContractCommitInfo>(*found);
+		}
+
+		void ContractStorageService::load_commit_index()
+		{
+			_commit_index.clear();
+			scan_commit_infos("order by id", [&](const ContractCommitInfo& commit_info) {
+				_commit_index.add(commit_info);
+			});
 		}
 
-		void ContractStorageService::add_commit_info(ContractCommitId commit_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id)
+		uint64_t ContractStorageService::add_commit_info(ContractWriteSet& writes, const ContractCommitId& commit_id, const std::string& saved_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id)
 		{
 			check_db();
 			auto commit_info_existed = get_commit_info(commit_id);
@@ -180,19 +416,446 @@ namespace contract
 			{
 				BOOST_THROW_EXCEPTION(ContractStorageException("same commitId existed before"));
 			}
-			char *insert_err;
-			auto insert_sql = std::string("insert into commit_info (commit_id, change_type, contract_id) values ('") + commit_id + "','" + change_type + "', '" + contract_id + "')";
-			auto insert_status = sqlite3_exec(_sql_db,
-				insert_sql.c_str(), &empty_sql_callback, nullptr, &insert_err);
-			if (insert_status != SQLITE_OK)
-			{
-				sqlite3_free(insert_err);
+			// state keys changed so far, the commit's own records are added after
+			const auto& changed_state = make_commit_notification(writes);
+			ContractCommitInfo commit_info;
+			commit_info.commit_id = commit_id;
+			commit_info.change_type = change_type;
+			commit_info.contract_id = contract_id;
+			commit_info.block_height = _current_block_height;
+			commit_info.state_root = state_tree_root(writes);
+			commit_info.keys_written = changed_state->changed_keys.size();
+			commit_info.diff_size = diff_str.size();
+			sqlite3_stmt* stmt = nullptr;
+			if (sqlite3_prepare_v2(_sql_db, "insert into commit_info (commit_id, change_type, contract_id, block_height, state_root, keys_written, diff_size) values (?, ?, ?, ?, ?, ?, ?)", -1, &stmt, nullptr) != SQLITE_OK)
 				BOOST_THROW_EXCEPTION(ContractStorageException("insert contract change commit to db error"));
-			}
+			BOOST_SCOPE_EXIT_ALL(&) {
+				sqlite3_finalize(stmt);
+			};
+			// binary commit ids are saved as blobs
+			if (uses_binary_commit_ids())
+				sqlite3_bind_blob(stmt, 1, saved_id.data(), (int)saved_id.size(), SQLITE_TRANSIENT);
+			else
+				sqlite3_bind_text(stmt, 1, saved_id.data(), (int)saved_id.size(), SQLITE_TRANSIENT);
+			sqlite3_bind_text(stmt, 2, change_type.data(), (int)change_type.size(), SQLITE_TRANSIENT);
+			sqlite3_bind_text(stmt, 3, contract_id.data(), (int)contract_id.size(), SQLITE_TRANSIENT);
+			sqlite3_bind_int64(stmt, 4, commit_info.block_height);
+			sqlite3_bind_text(stmt, 5, commit_info.state_root.data(), (int)commit_info.state_root.size(), SQLITE_TRANSIENT);
+			sqlite3_bind_int64(stmt, 6, (sqlite3_int64)commit_info.keys_written);
+			sqlite3_bind_int64(stmt, 7, (sqlite3_int64)commit_info.diff_size);
+			if (sqlite3_step(stmt) != SQLITE_DONE)
+				BOOST_THROW_EXCEPTION(ContractStorageException("insert contract change commit to db error"));
+			auto commit_seq = (uint64_t)sqlite3_last_insert_rowid(_sql_db);
+			commit_info.id = commit_seq;
+			_commit_index.add(commit_info);
+			for (const auto& changed_contract_id : changed_state->changed_contracts)
+				exec_sql(_sql_db, std::string("insert into commit_contracts (contract_id, commit_seq) values ('") + changed_contract_id + "', " + std::to_string(commit_seq) + ")");
+			// the format is fixed by the first commit saving it
+			std::string commit_id_format;
+			if (uses_binary_commit_ids() && !writes.get(commit_id_format_key, &commit_id_format))
+				writes.put(commit_id_format_key, binary_commit_id_format);
+			writes.put(saved_id, diff_str);
+			return commit_seq;
+		}
+
+		void ContractStorageService::write_changes(const ContractWriteSet& writes, std::vector<std::string>& changed_leveldb_keys)
+		{
+			check_db();
+			if (writes.empty())
+				return;
 			leveldb::WriteOptions write_options;
-			auto save_diff_status = _db->Put(write_options, commit_id, diff_str);
-			if (!save_diff_status.ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("save contract info diff to db error"));
+			leveldb::WriteBatch batch;
+			writes.write_to(&batch);
+			// push keys before writing, so the failed batch will be rollbacked too
+			const auto& keys = writes.changed_keys();
+			changed_leveldb_keys.insert(changed_leveldb_keys.end(), keys.begin(), keys.end());
+			if (!_db->Write(write_options, &batch).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("write contract changes to db error"));
+			const auto& items = writes.items();
+			auto root_it = items.find(root_state_hash_key);
+			if (root_it != items.end())
+				_saved_root_state_hash = root_it->second.deleted ? std::string() : root_it->second.value;
+			auto top_it = items.find(top_root_state_hash_key);
+			if (top_it != items.end())
+			{
+				_saved_top_root_state_hash = top_it->second.deleted ? std::string() : top_it->second.value;
+				// the first commit fixes the format
+				if (!_commit_id_format_loaded)
+					load_commit_id_format();
+			}
+		}
+
+		void ContractStorageService::load_root_state_hashes()
+		{
+			check_db();
+			leveldb::ReadOptions read_options;
+			if (!_db->Get(read_options, root_state_hash_key, &_saved_root_state_hash).ok())
+				_saved_root_state_hash.clear();
+			if (!_db->Get(read_options, top_root_state_hash_key, &_saved_top_root_state_hash).ok())
+				_saved_top_root_state_hash.clear();
+			load_commit_id_format();
+		}
+
+		void ContractStorageService::load_commit_id_format()
+		{
+			leveldb::ReadOptions read_options;
+			std::string value;
+			if (_db->Get(read_options, commit_id_format_key, &value).ok())
+			{
+				_binary_commit_ids = value == binary_commit_id_format;
+				_commit_id_format_loaded = true;
+			}
+			// dbs committed before without the format saved use hex commit ids
+			else if (_db->Get(read_options, top_root_state_hash_key, &value).ok())
+			{
+				_binary_commit_ids = false;
+				_commit_id_format_loaded = true;
+			}
+			// not decided before the first commit
+			else
+				_commit_id_format_loaded = false;
+		}
+
+		void ContractStorageService::update_state_tree(ContractWriteSet& writes) const
+		{
+			std::string built;
+			if (!_options.state_tree)
+			{
+				if (writes.get(state_tree_built_key, &built))
+					writes.remove(state_tree_built_key);
+				return;
+			}
+			if (!writes.get(state_tree_built_key, &built))
+			{
+				build_state_tree(writes);
+				return;
+			}
+			// copy changed leaves first, the tree adds its nodes to writes
+			std::vector<std::pair<std::string, ContractWriteSetItem>> changed_leaves;
+			for (const auto& p : writes.items())
+			{
+				const auto& item = p.second;
+				if (!is_state_tree_leaf_key(p.first))
+					continue;
+				if (item.deleted ? !item.existed : (item.existed && item.value == item.old_value))
+					continue;
+				changed_leaves.push_back(p);
+			}
+			ContractStateTree tree(writes);
+			for (const auto& p : changed_leaves)
+			{
+				if (p.second.deleted)
+					tree.remove(p.first);
+				else
+					tree.put(p.first, p.second.value);
+			}
+		}
+
+		void ContractStorageService::build_state_tree(ContractWriteSet& writes) const
+		{
+			leveldb::ReadOptions read_options;
+			read_options.fill_cache = false;
+			std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(read_options));
+			// nodes left by a dropped tree
+			for (it->Seek(ContractStateTree::node_key_prefix); it->Valid() && it->key().starts_with(ContractStateTree::node_key_prefix); it->Next())
+			{
+				writes.remove(it->key().ToString());
+			}
+			ContractStateTree tree(writes);
+			std::string value;
+			for (const auto& prefix : { contract_info_key_prefix, contract_storage_key_prefix })
+			{
+				for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next())
+				{
+					const auto& key = it->key().ToString();
+					if (writes.get(key, &value))
+						tree.put(key, value);
+				}
+			}
+			if (!it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("read state for state tree error"));
+			// pending keys not in db yet
+			std::vector<std::string> pending_keys;
+			for (const auto& p : writes.items())
+			{
+				if (is_state_tree_leaf_key(p.first) && !p.second.deleted)
+					pending_keys.push_back(p.first);
+			}
+			for (const auto& key : pending_keys)
+			{
+				if (writes.get(key, &value))
+					tree.put(key, value);
+			}
+			writes.put(state_tree_built_key, "1");
+		}
+
+		std::string ContractStorageService::current_state_root() const
+		{
+			check_db();
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			ContractWriteSet reader(_db, snapshot);
+			return state_tree_root(reader);
+		}
+
+		void ContractStorageService::update_state_set_hash(ContractWriteSet& writes) const
+		{
+			// start from the hash of db state, pending changes of state keys are applied on it
+			std::string saved;
+			bool has_saved;
+			const auto& items = writes.items();
+			auto saved_item = items.find(state_set_hash_key);
+			if (saved_item != items.end())
+			{
+				has_saved = saved_item->second.existed;
+				saved = saved_item->second.old_value;
+			}
+			else
+			{
+				has_saved = writes.get(state_set_hash_key, &saved);
+			}
+			auto set_hash = has_saved ? ContractStateSetHash::from_bytes(saved) : scan_state_set_hash(nullptr);
+			for (const auto& p : items)
+			{
+				const auto& item = p.second;
+				if (!is_state_set_key(p.first))
+					continue;
+				if (item.deleted ? !item.existed : (item.existed && item.value == item.old_value))
+					continue;
+				if (item.existed)
+					set_hash.remove(p.first, item.old_value);
+				if (!item.deleted)
+					set_hash.add(p.first, item.value);
+			}
+			writes.put(state_set_hash_key, set_hash.bytes());
+		}
+
+		ContractStateSetHash ContractStorageService::scan_state_set_hash(const leveldb::Snapshot* snapshot) const
+		{
+			// split keys of every prefix to 16 ranges by high 4 bits of the byte after prefix
+			struct KeyRange
+			{
+				std::string start;
+				std::string limit;
+			};
+			std::vector<KeyRange> ranges;
+			for (const auto& prefix : { contract_info_key_prefix, contract_storage_key_prefix, contract_name_id_mapping_key_prefix })
+			{
+				auto prefix_limit = prefix;
+				prefix_limit[prefix_limit.size() - 1]++;
+				for (int i = 0; i < 16; i++)
+				{
+					KeyRange range;
+					range.start = i == 0 ? prefix : prefix + (char)(i * 16);
+					range.limit = i == 15 ? prefix_limit : prefix + (char)((i + 1) * 16);
+					ranges.push_back(range);
+				}
+			}
+			std::vector<ContractStateSetHash> range_hashes(ranges.size());
+			std::vector<char> range_failed(ranges.size(), 0);
+			auto scan_range = [&](size_t index) {
+				leveldb::ReadOptions read_options;
+				read_options.snapshot = snapshot;
+				read_options.fill_cache = false;
+				std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(read_options));
+				const auto& range = ranges[index];
+				for (it->Seek(range.start); it->Valid() && it->key().compare(range.limit) < 0; it->Next())
+				{
+					range_hashes[index].add(it->key().ToString(), it->value().ToString());
+				}
+				range_failed[index] = it->status().ok() ? 0 : 1;
+			};
+			size_t threads_count = _options.state_scan_threads > 0 ? _options.state_scan_threads : std::thread::hardware_concurrency();
+			threads_count = std::max<size_t>(1, std::min(threads_count, ranges.size()));
+			std::atomic<size_t> next(0);
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < threads_count; i++)
+			{
+				threads.push_back(std::thread([&]() {
+					size_t pos;
+					while ((pos = next++) < ranges.size())
+						scan_range(pos);
+				}));
+			}
+			for (auto& thread : threads)
+				thread.join();
+			ContractStateSetHash set_hash;
+			for (size_t i = 0; i < ranges.size(); i++)
+			{
+				if (range_failed[i])
+					BOOST_THROW_EXCEPTION(ContractStorageException("read state for state set hash error"));
+				set_hash.merge(range_hashes[i]);
+			}
+			return set_hash;
+		}
+
+		std::string ContractStorageService::current_state_set_hash() const
+		{
+			check_db();
+			leveldb::ReadOptions read_options;
+			std::string saved;
+			if (!_db->Get(read_options, state_set_hash_key, &saved).ok())
+				return "";
+			return ContractStateSetHash::from_bytes(saved).str();
+		}
+
+		std::string ContractStorageService::compute_state_set_hash() const
+		{
+			check_db();
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			return scan_state_set_hash(snapshot).str();
+		}
+
+		bool ContractStorageService::verify_state_set_hash() const
+		{
+			check_db();
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = snapshot;
+			std::string saved;
+			if (!_db->Get(read_options, state_set_hash_key, &saved).ok())
+				return false;
+			return ContractStateSetHash::from_bytes(saved) == scan_state_set_hash(snapshot);
+		}
+
+		// commits read and verified in one round, so the history is not loaded at once
+		static const size_t verify_history_batch_commits = 4096;
+
+		bool ContractStorageService::recompute_commit_digest(const ContractCommitInfo& commit_info, const leveldb::Snapshot* snapshot, fcrypto::sha256& digest) const
+		{
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = snapshot;
+			read_options.fill_cache = false;
+			const auto& commit_key = saved_commit_id(commit_info.commit_id);
+			std::string diff_str;
+			if (!_db->Get(read_options, commit_key, &diff_str).ok())
+				return false;
+			const auto& diff_json = jsondiff::json_loads(diff_str);
+			if (commit_info.change_type == CONTRACT_STORAGE_CHANGE_TYPE)
+			{
+				// the diff is the committed changes
+				auto changes = std::make_shared<ContractChanges>(ContractChanges::from_json(diff_json.as<jsondiff::JsonObject>()));
+				digest = hash_contract_changes(changes);
+				return true;
+			}
+			if (commit_info.change_type != CONTRACT_INFO_CHANGE_TYPE)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not supported change type ") + commit_info.change_type));
+			// the saved contract info is the diff applied to its pre-image in undo record
+			std::string undo_record;
+			if (!_db->Get(read_options, make_commit_undo_key(commit_key), &undo_record).ok())
+				return false;
+			jsondiff::JsonValue old_json = jsondiff::JsonObject();
+			const auto& contract_info_key = make_contract_info_key(commit_info.contract_id);
+			for (const auto& item : decode_undo_items(undo_record))
+			{
+				if (item.key == contract_info_key && item.existed)
+					old_json = jsondiff::json_loads(item.value);
+			}
+			jsondiff::JsonDiff differ;
+			const auto& contract_info_json = differ.patch(old_json, std::make_shared<jsondiff::DiffResult>(diff_json));
+			auto contract_info = ContractInfo::from_json(contract_info_json);
+			if (!contract_info)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract info of commit ") + commit_info.commit_id + " format error"));
+			digest = hash_new_contract_info_commit(contract_info);
+			return true;
+		}
+
+		ContractHistoryVerifyResult ContractStorageService::verify_history() const
+		{
+			check_db();
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			enum DigestStatus
+			{
+				DIGEST_COMPUTED = 0,
+				DIGEST_INPUTS_MISSING = 1,
+				DIGEST_ERROR = 2
+			};
+			ContractHistoryVerifyResult result;
+			ContractCommitId prev_commit_id = EMPTY_COMMIT_ID;
+			uint64_t last_seq = 0;
+			size_t threads_count = _options.state_scan_threads > 0 ? _options.state_scan_threads : std::thread::hardware_concurrency();
+			threads_count = std::max<size_t>(1, threads_count);
+			for (;;)
+			{
+				jsondiff::JsonArray records;
+				exec_sql(_sql_db, std::string("select id, ") + commit_id_sql_column() + ", change_type, contract_id, ifnull(block_height, 0) as block_height, block_height is null as height_unrecorded from commit_info where id>"
+					+ std::to_string(last_seq) + " order by id asc limit " + std::to_string(verify_history_batch_commits), &records);
+				if (records.empty())
+					break;
+				std::vector<ContractCommitInfo> commit_infos;
+				std::vector<char> heights_unrecorded;
+				for (const auto& item : records)
+				{
+					const auto& record = item.as<jsondiff::JsonObject>();
+					ContractCommitInfo commit_info;
+					commit_info.id = record["id"].as_uint64();
+					commit_info.commit_id = record["commit_id"].as_string();
+					commit_info.change_type = record["change_type"].as_string();
+					commit_info.contract_id = record["contract_id"].as_string();
+					commit_info.block_height = (uint32_t)record["block_height"].as_uint64();
+					commit_infos.push_back(commit_info);
+					heights_unrecorded.push_back(record["height_unrecorded"].as_uint64() != 0);
+				}
+
+				// digests are independent, only chaining them needs the commit order
+				std::vector<fcrypto::sha256> digests(commit_infos.size());
+				std::vector<char> statuses(commit_infos.size(), DIGEST_COMPUTED);
+				auto compute_digest = [&](size_t index) {
+					try
+					{
+						if (!recompute_commit_digest(commit_infos[index], snapshot, digests[index]))
+							statuses[index] = DIGEST_INPUTS_MISSING;
+					}
+					catch (...)
+					{
+						statuses[index] = DIGEST_ERROR;
+					}
+				};
+				std::atomic<size_t> next(0);
+				std::vector<std::thread> threads;
+				for (size_t i = 0; i < std::min(threads_count, commit_infos.size()); i++)
+				{
+					threads.push_back(std::thread([&]() {
+						size_t pos;
+						while ((pos = next++) < commit_infos.size())
+							compute_digest(pos);
+					}));
+				}
+				for (auto& thread : threads)
+					thread.join();
+
+				for (size_t i = 0; i < commit_infos.size(); i++)
+				{
+					const auto& commit_info = commit_infos[i];
+					result.commits_count++;
+					// rows are only deleted from the top by rollbacks, a first row after 1 means older commits are pruned
+					bool prev_known = result.commits_count > 1 || commit_info.id == 1;
+					if (statuses[i] == DIGEST_ERROR)
+						result.mismatched_commit_ids.push_back(commit_info.commit_id);
+					// commits saved before block heights were recorded can't be rechained
+					else if (statuses[i] == DIGEST_INPUTS_MISSING || !prev_known || heights_unrecorded[i])
+						result.unverifiable_count++;
+					else if (chain_commit_id(saved_commit_id(prev_commit_id), digests[i], commit_info.block_height).str() == commit_info.commit_id)
+						result.verified_count++;
+					else
+						result.mismatched_commit_ids.push_back(commit_info.commit_id);
+					// next commit is chained from the saved id, so a bad commit doesn't fail all later ones
+					prev_commit_id = commit_info.commit_id;
+				}
+				last_seq = commit_infos.back().id;
+			}
+			return result;
 		}
 
 		std::string ContractStorageService::get_value_by_key_or_error(const std::string &key)
@@ -239,12 +902,18 @@ namespace contract
 		{
 			check_db();
 			char *err;
-			if (sqlite3_exec(_sql_db, "BEGIN", nullptr, nullptr, &err) != SQLITE_OK)
+			// the pruning and checkpoint threads write by their own connections. a deferred transaction upgrading
+			// its read lock gets SQLITE_BUSY without the busy handler, so the write lock is taken at begin
+			if (sqlite3_exec(_sql_db, "BEGIN IMMEDIATE", nullptr, nullptr, &err) != SQLITE_OK)
 			{
 				std::string err_str = std::string("contract sql transaction begin error ") + err;
 				sqlite3_free(err);
 				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
 			}
+			_sql_transaction_open = true;
+			auto top = _commit_index.top();
+			_sql_transaction_start_seq = top ? top->id : 0;
+			_sql_transaction_removed_commits = false;
 		}
 		void ContractStorageService::commit_sql_transaction()
 		{
@@ -256,10 +925,25 @@ namespace contract
 				sqlite3_free(err);
 				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
 			}
+			_sql_transaction_open = false;
+			// rows of these checkpoints are deleted now
+			for (const auto& path : _pending_checkpoint_removals)
+				leveldb::DestroyDB(path, leveldb::Options());
+			_pending_checkpoint_removals.clear();
+			if (_pending_checkpoint)
+			{
+				auto commit_info = *_pending_checkpoint;
+				_pending_checkpoint.reset();
+				start_background_checkpoint(commit_info);
+			}
 		}
 		void ContractStorageService::rollback_sql_transaction()
 		{
 			check_db();
+			_sql_transaction_open = false;
+			// checkpoint rows deleted in the transaction are back
+			_pending_checkpoint_removals.clear();
+			_pending_checkpoint.reset();
 			char *err;
 			if (sqlite3_exec(_sql_db, "ROLLBACK", nullptr, nullptr, &err) != SQLITE_OK)
 			{
@@ -267,6 +951,11 @@ namespace contract
 				sqlite3_free(err);
 				BOOST_THROW_EXCEPTION(ContractStorageException(err_str));
 			}
+			// commit_info changes of the transaction are undone. it only adds commits unless it rollbacked some
+			if (_sql_transaction_removed_commits)
+				load_commit_index();
+			else
+				_commit_index.remove_after(_sql_transaction_start_seq);
 		}
 
 		void ContractStorageService::rollback_leveldb_transaction(const leveldb::Snapshot* snapshot_to_rollback, const std::vector<std::string>& changed_keys)
@@ -287,6 +976,7 @@ namespace contract
 					_db->Delete(write_options, key);
 				}
 			}
+			load_root_state_hashes();
 		}
 
 		ContractInfoP ContractStorageService::get_contract_info(const AddressType& contract_id) const
@@ -326,11 +1016,7 @@ namespace contract
 		ContractCommitId ContractStorageService::current_root_state_hash() const
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
-			std::string state_hash;
-			if (!_db->Get(read_options, root_state_hash_key, &state_hash).ok())
-				state_hash = EMPTY_COMMIT_ID;
-			return state_hash;
+			return commit_id_from_saved(_saved_root_state_hash);
 		}
 
 		bool ContractStorageService::is_current_root_state_hash_after(const ContractCommitId& other_root_state_hash) const
@@ -357,18 +1043,16 @@ namespace contract
 		ContractCommitId ContractStorageService::top_root_state_hash() const
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
-			std::string state_hash;
-			if (!_db->Get(read_options, top_root_state_hash_key, &state_hash).ok())
-				state_hash = EMPTY_COMMIT_ID;
-			return state_hash;
+			return commit_id_from_saved(_saved_top_root_state_hash);
 		}
 
 		ContractCommitId ContractStorageService::save_contract_info(ContractInfoP contract_info)
 		{
 			check_db();
+			// the commits after root state hash and their checkpoints may be removed
+			if (!is_latest())
+				wait_background_checkpoint();
 			bool success = false;
-			leveldb::WriteOptions write_options;
 			// snapshot leveldb for rollback
 			const auto snapshot = _db->GetSnapshot();
 			BOOST_SCOPE_EXIT_ALL(&) {
@@ -380,35 +1064,37 @@ namespace contract
 				if (success)
 				{
 					commit_sql_transaction();
+					publish_notifications();
 				}
 				else
 				{
+					_pending_notifications.clear();
 					rollback_sql_transaction();
 					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
 				}
 			};
-			const auto& old_root_state_hash = current_root_state_hash();
-			const auto& top_commit_id = top_root_state_hash();
-			if (old_root_state_hash != top_commit_id) {
+			if (!is_latest()) {
+				const auto& old_root_state_hash = current_root_state_hash();
+				const auto& next_commit_id = generate_next_root_hash(_saved_root_state_hash, hash_new_contract_info_commit(contract_info)).str();
+				if (redo_recorded_commit(old_root_state_hash, next_commit_id, changed_leveldb_keys)) {
+					success = true;
+					return next_commit_id;
+				}
 				rollback_to_root_state_hash_without_transactional(old_root_state_hash, changed_leveldb_keys);
 				assert(current_root_state_hash() == old_root_state_hash);
 			}
 
+			ContractWriteSet writes(_db);
 			auto key = make_contract_info_key(contract_info->id);
-			leveldb::ReadOptions read_options;
 			std::string old_value;
 			jsondiff::JsonObject old_json_value;
-			auto read_status = _db->Get(read_options, key, &old_value);
-			if (read_status.ok())
+			if (writes.get(key, &old_value))
 			{
 				old_json_value = jsondiff::json_loads(old_value).as<jsondiff::JsonObject>();
 			}
 
 			auto json_obj = contract_info->to_json();
-			auto status = _db->Put(write_options, key, jsondiff::json_dumps(json_obj));
-			if (!status.ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("save contract info to db error"));
-			changed_leveldb_keys.push_back(key);
+			writes.put(key, jsondiff::json_dumps(json_obj));
 			jsondiff::JsonDiff differ;
 			auto contract_info_diff = differ.diff(old_json_value, json_obj);
 			std::string contract_info_diff_str = contract_info_diff->str();
@@ -419,23 +1105,32 @@ namespace contract
 				// check name unique(exist contract with this name's id must be same or empty)
 				const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
 				std::string exist_name_id;
-				if (_db->Get(read_options, contract_name_id_mapping_key, &exist_name_id).ok() && exist_name_id != contract_info->id)
+				if (writes.get(contract_name_id_mapping_key, &exist_name_id) && exist_name_id != contract_info->id)
 					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("contract name ") + contract_info->name + " existed before"));
-				if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("save contract name => contract id mapping to db error"));
-				changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+				writes.put(contract_name_id_mapping_key, contract_info->id);
 			}
 
 			// update root-state-hash
-			const auto& root_state_hash = generate_next_root_hash(old_root_state_hash, hash_new_contract_info_commit(contract_info));
-			ContractCommitId commitId = root_state_hash;
-			add_commit_info(commitId, CONTRACT_INFO_CHANGE_TYPE, contract_info_diff_str, contract_info->id);
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
+			const auto& root_state_hash = generate_next_root_hash(_saved_root_state_hash, hash_new_contract_info_commit(contract_info));
+			ContractCommitId commitId = root_state_hash.str();
+			const auto& saved_root_state_hash = saved_commit_id(root_state_hash);
+			update_state_tree(writes);
+			update_state_set_hash(writes);
+			auto commit_seq = add_commit_info(writes, commitId, saved_root_state_hash, CONTRACT_INFO_CHANGE_TYPE, contract_info_diff_str, contract_info->id);
+			add_commit_undo_record(writes, saved_root_state_hash);
+			writes.put(root_state_hash_key, saved_root_state_hash);
+			writes.put(top_root_state_hash_key, saved_root_state_hash);
+			if (has_subscribers())
+			{
+				auto notification = make_commit_notification(writes);
+				notification->commit_id = commitId;
+				notification->commit_seq = commit_seq;
+				notification->block_height = _current_block_height;
+				_pending_notifications.push_back(notification);
+			}
+			write_changes(writes, changed_leveldb_keys);
+			create_checkpoint_if_needed(commitId);
+			finalize_old_blocks_if_needed();
 			success = true;
 			return commitId;
 		}
@@ -443,9 +1138,7 @@ namespace contract
 		bool ContractStorageService::is_latest() const
 		{
 			check_db();
-			const auto& old_root_state_hash = current_root_state_hash();
-			const auto& top_commit_id = top_root_state_hash();
-			return old_root_state_hash == top_commit_id;
+			return _saved_root_state_hash == _saved_top_root_state_hash;
 		}
 
 		jsondiff::JsonValue ContractStorageService::get_contract_storage(AddressType contract_id, const std::string& storage_name) const
@@ -500,14 +1193,17 @@ namespace contract
 		{
 			check_db();
 			auto events = std::make_shared<std::vector<ContractEventInfo>>();
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
+			auto commit_info = get_commit_info(commit_id);
+			if (commit_info)
+			{
+				for (auto it = iterate_events(commit_info->id, commit_info->id); it->valid(); it->next())
+					events->push_back(it->entry().event);
+				if (!events->empty())
+					return events;
+			}
+			// commits saved before the event log
 			leveldb::ReadOptions read_options;
-			read_options.snapshot = snapshot;
-			const auto& commit_events_key = make_commit_events_key(commit_id);
-
+			const auto& commit_events_key = make_commit_events_key(saved_commit_id(commit_id));
 			std::string events_str_value;
 			if (_db->Get(read_options, commit_events_key, &events_str_value).ok()) {
 				const auto& json_obj = jsondiff::json_loads(events_str_value);
@@ -515,20 +1211,15 @@ namespace contract
 					*events = ContractChanges::events_from_json(json_obj.as<jsondiff::JsonArray>());
 				}
 			}
-			return events; 
+			return events;
 		}
 
 		std::shared_ptr<std::vector<ContractEventInfo>> ContractStorageService::get_transaction_events(const std::string& transaction_id) const
 		{
 			check_db();
 			auto events = std::make_shared<std::vector<ContractEventInfo>>();
-			auto snapshot = _db->GetSnapshot();
-			BOOST_SCOPE_EXIT_ALL(&) {
-				_db->ReleaseSnapshot(snapshot);
-			};
+			// events of the transaction's last commit saved before the event log come first
 			leveldb::ReadOptions read_options;
-			read_options.snapshot = snapshot;
-
 			const auto& tx_events_key = make_transaction_events_key(transaction_id);
 			std::string value;
 			if (_db->Get(read_options, tx_events_key, &value).ok()) {
@@ -537,12 +1228,74 @@ namespace contract
 					*events = ContractChanges::events_from_json(events_json.as<jsondiff::JsonArray>());
 				}
 			}
+			for (auto it = iterate_transaction_events(transaction_id); it->valid(); it->next())
+				events->push_back(it->entry().event);
 			return events;
 		}
 
+		ContractEventLogIteratorP ContractStorageService::iterate_events(uint64_t from_commit_seq, uint64_t to_commit_seq) const
+		{
+			check_db();
+			return ContractEventLogIteratorP(new ContractEventLogIterator(_db, nullptr, "", "", ContractEventLog::make_position(from_commit_seq, 0), to_commit_seq));
+		}
+
+		ContractEventLogIteratorP ContractStorageService::iterate_transaction_events(const std::string& transaction_id) const
+		{
+			check_db();
+			return ContractEventLogIteratorP(new ContractEventLogIterator(_db, nullptr, ContractEventLog::transaction_index_prefix, transaction_id, ContractEventLog::make_position(0, 0), UINT64_MAX));
+		}
+
+		ContractEventLogIteratorP ContractStorageService::iterate_contract_events(const AddressType& contract_id, uint64_t from_commit_seq, uint64_t to_commit_seq) const
+		{
+			check_db();
+			return ContractEventLogIteratorP(new ContractEventLogIterator(_db, nullptr, ContractEventLog::contract_index_prefix, contract_id, ContractEventLog::make_position(from_commit_seq, 0), to_commit_seq));
+		}
+
+		ContractEventLogIteratorP ContractStorageService::iterate_events_by_name(const std::string& event_name, uint64_t from_commit_seq, uint64_t to_commit_seq) const
+		{
+			check_db();
+			return ContractEventLogIteratorP(new ContractEventLogIterator(_db, nullptr, ContractEventLog::name_index_prefix, event_name, ContractEventLog::make_position(from_commit_seq, 0), to_commit_seq));
+		}
+
+		ContractEventCursorP ContractStorageService::query_events(const ContractEventFilter& filter) const
+		{
+			check_db();
+			auto from_commit_seq = filter.from_commit_seq;
+			auto to_commit_seq = filter.to_commit_seq;
+			std::function<bool(uint64_t)> commit_seq_matches;
+			if (filter.from_block_height > 0 || filter.to_block_height < UINT32_MAX)
+			{
+				// commits of the heights are in the seq range from the first to the last of them
+				jsondiff::JsonArray records;
+				exec_sql(_sql_db, std::string("select min(id) as from_seq, max(id) as to_seq from commit_info where block_height>=") + std::to_string(filter.from_block_height)
+					+ " and block_height<=" + std::to_string(filter.to_block_height), &records);
+				auto record = records.empty() ? jsondiff::JsonObject() : records[0].as<jsondiff::JsonObject>();
+				if (record.find("from_seq") == record.end() || record["from_seq"].is_null())
+				{
+					from_commit_seq = 1;
+					to_commit_seq = 0;
+				}
+				else
+				{
+					from_commit_seq = std::max(from_commit_seq, record["from_seq"].as_uint64());
+					to_commit_seq = std::min(to_commit_seq, record["to_seq"].as_uint64());
+					// block heights may go down after set_current_block_height, so commits in the range are checked by their heights
+					// in the commit index when the cursor reads their events
+					auto from_block_height = filter.from_block_height;
+					auto to_block_height = filter.to_block_height;
+					commit_seq_matches = [this, from_block_height, to_block_height](uint64_t commit_seq) {
+						auto commit_info = _commit_index.find_seq(commit_seq);
+						return commit_info && commit_info->block_height >= from_block_height && commit_info->block_height <= to_block_height;
+					};
+				}
+			}
+			return ContractEventCursorP(new ContractEventCursor(_db, filter, from_commit_seq, to_commit_seq, commit_seq_matches));
+		}
+
 		void ContractStorageService::clear_sql_db()
 		{
 			check_db();
+			wait_background_checkpoint();
 			char *err_msg;
 			auto drop_status = sqlite3_exec(_sql_db, "delete from commit_info", &empty_sql_callback, nullptr, &err_msg);
 			if (drop_status != SQLITE_OK)
@@ -551,53 +1304,182 @@ namespace contract
 				sqlite3_free(err_msg);
 				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
 			}
+			drop_status = sqlite3_exec(_sql_db, "delete from commit_finalized", &empty_sql_callback, nullptr, &err_msg);
+			if (drop_status != SQLITE_OK)
+			{
+				std::string err_msg_str(err_msg);
+				sqlite3_free(err_msg);
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+			}
+			exec_sql(_sql_db, "delete from commit_contracts");
+			_commit_index.clear();
+			remove_checkpoints_after(0);
 		}
 
-		// save commit history with all diffs
-		ContractCommitId ContractStorageService::commit_contract_changes(ContractChangesP changes)
+		struct PreparedContractChanges
+		{
+			ContractChangesP changes;
+			std::shared_ptr<ContractWriteSet> writes;
+			fcrypto::sha256 digest;
+			std::string diff_str;
+			std::exception_ptr error;
+		};
+
+		struct ContractChangesKeySet
+		{
+			std::set<std::string> keys;
+			// upgrades touch contract name mappings only known after applying, so they can't be prepared ahead
+			bool exclusive = false;
+		};
+
+		// leveldb keys read or written when applying the changes
+		static ContractChangesKeySet contract_changes_key_set(const ContractChanges& changes)
+		{
+			ContractChangesKeySet key_set;
+			for (const auto& balance_change : changes.balance_changes)
+			{
+				if (balance_change.is_contract)
+					key_set.keys.insert(make_contract_info_key(balance_change.address));
+			}
+			for (const auto& storage_change : changes.storage_changes)
+			{
+				for (const auto& item : storage_change.items)
+				{
+					key_set.keys.insert(make_contract_storage_key(storage_change.contract_id, item.name));
+				}
+			}
+			for (const auto& upgrade_info : changes.upgrade_infos)
+			{
+				key_set.keys.insert(make_contract_info_key(upgrade_info.contract_id));
+				key_set.exclusive = true;
+			}
+			return key_set;
+		}
+
+		static std::vector<ContractBalance> contract_balances_from_info_value(const std::string& value)
+		{
+			std::vector<ContractBalance> result;
+			auto json_value = jsondiff::json_loads(value);
+			if (!json_value.is_object())
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
+			auto json_obj = json_value.as<jsondiff::JsonObject>();
+			auto balances_json_array = json_obj["balances"].as<jsondiff::JsonArray>();
+			for (size_t i = 0; i < balances_json_array.size(); i++)
+			{
+				auto balance_item_json = balances_json_array[i].as<jsondiff::JsonObject>();
+				ContractBalance balance;
+				balance.asset_id = (uint32_t)balance_item_json["asset_id"].as_uint64();
+				balance.amount = balance_item_json["amount"].as_uint64();
+				result.push_back(balance);
+			}
+			return result;
+		}
+
+		static std::vector<ContractBalance> read_contract_balances(const ContractWriteSet& writes, const AddressType& contract_id)
+		{
+			std::string value;
+			if (!writes.get(make_contract_info_key(contract_id), &value)) {
+				return std::vector<ContractBalance>();
+			}
+			return contract_balances_from_info_value(value);
+		}
+
+		static jsondiff::JsonValue read_json_value_or_null(const ContractWriteSet& writes, const std::string& key)
+		{
+			std::string value;
+			if (!writes.get(key, &value))
+				return jsondiff::JsonValue();
+			return jsondiff::json_loads(value);
+		}
+
+		static ContractInfoP read_contract_info(const ContractWriteSet& writes, const AddressType& contract_id)
+		{
+			std::string value;
+			if (!writes.get(make_contract_info_key(contract_id), &value))
+				return nullptr;
+			auto json_value = jsondiff::json_loads(value);
+			if (!json_value.is_object())
+				BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
+			return ContractInfo::from_json(json_value);
+		}
+
+		jsondiff::JsonValue ContractStorageService::get_contract_storage_with_proof(AddressType contract_id, const std::string& storage_name, ContractStateProof& proof) const
 		{
 			check_db();
-			leveldb::ReadOptions read_options;
-			leveldb::WriteOptions write_options;
-			// snapshot leveldb for rollback
 			const auto snapshot = _db->GetSnapshot();
 			BOOST_SCOPE_EXIT_ALL(&) {
 				_db->ReleaseSnapshot(snapshot);
 			};
-			std::vector<std::string> changed_leveldb_keys;
-			const auto& old_root_state_hash = current_root_state_hash();
-			const auto& top_commit_id = top_root_state_hash();
-			if (old_root_state_hash != top_commit_id) {
-				rollback_to_root_state_hash_without_transactional(old_root_state_hash, changed_leveldb_keys);
-				assert(current_root_state_hash() == old_root_state_hash);
-			}
-			if (changes->empty()) {
-				return old_root_state_hash;
-			}
-			const auto& root_state_hash = generate_next_root_hash(old_root_state_hash, hash_contract_changes(changes));
-			ContractCommitId commitId = root_state_hash;
-			// check commitId not conflict
-			if(get_commit_info(commitId))
-				BOOST_THROW_EXCEPTION(ContractStorageException("same commitId existed before"));
-			bool success = false;
-			begin_sql_transaction();
+			ContractWriteSet reader(_db, snapshot);
+			std::string built;
+			if (!reader.get(state_tree_built_key, &built))
+				BOOST_THROW_EXCEPTION(ContractStorageException("state tree is not enabled"));
+			proof = ContractStateTree(reader).prove(make_contract_storage_key(contract_id, storage_name));
+			if (!proof.exists)
+				return jsondiff::JsonValue();
+			return jsondiff::json_loads(proof.value);
+		}
+
+		std::vector<ContractBalance> ContractStorageService::get_contract_balances_with_proof(const AddressType& contract_id, ContractStateProof& proof) const
+		{
+			check_db();
+			const auto snapshot = _db->GetSnapshot();
 			BOOST_SCOPE_EXIT_ALL(&) {
-				if (success)
-				{
-					commit_sql_transaction();
-				}
-				else
-				{
-					rollback_sql_transaction();
-					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
-				}
+				_db->ReleaseSnapshot(snapshot);
 			};
+			ContractWriteSet reader(_db, snapshot);
+			std::string built;
+			if (!reader.get(state_tree_built_key, &built))
+				BOOST_THROW_EXCEPTION(ContractStorageException("state tree is not enabled"));
+			// balances are saved in contract info, so the contract info is proved
+			proof = ContractStateTree(reader).prove(make_contract_info_key(contract_id));
+			if (!proof.exists)
+				return std::vector<ContractBalance>();
+			return contract_balances_from_info_value(proof.value);
+		}
+
+		bool ContractStorageService::verify_contract_storage_proof(const std::string& state_root, const AddressType& contract_id, const std::string& storage_name, const jsondiff::JsonValue& value, const ContractStateProof& proof)
+		{
+			if (proof.key != make_contract_storage_key(contract_id, storage_name))
+				return false;
+			if (!ContractStateTree::verify(proof, fcrypto::sha256(state_root)))
+				return false;
+			if (!proof.exists)
+				return value.is_null();
+			return jsondiff::json_dumps(jsondiff::json_loads(proof.value)) == jsondiff::json_dumps(value);
+		}
+
+		bool ContractStorageService::verify_contract_balances_proof(const std::string& state_root, const AddressType& contract_id, const std::vector<ContractBalance>& balances, const ContractStateProof& proof)
+		{
+			if (proof.key != make_contract_info_key(contract_id))
+				return false;
+			if (!ContractStateTree::verify(proof, fcrypto::sha256(state_root)))
+				return false;
+			if (!proof.exists)
+				return balances.empty();
+			const auto& proved_balances = contract_balances_from_info_value(proof.value);
+			if (proved_balances.size() != balances.size())
+				return false;
+			for (size_t i = 0; i < balances.size(); i++)
+			{
+				if (proved_balances[i].asset_id != balances[i].asset_id || proved_balances[i].amount != balances[i].amount)
+					return false;
+			}
+			return true;
+		}
+
+		void ContractStorageService::prepare_contract_changes(PreparedContractChanges& prepared) const
+		{
+			auto& writes = *prepared.writes;
+			const auto& changes = prepared.changes;
+			prepared.digest = hash_contract_changes(changes);
+			prepared.diff_str = jsondiff::json_dumps(changes->to_json());
 			// merge change to leveldb
 			for (const auto &balance_change : changes->balance_changes)
 			{
 				if (!balance_change.is_contract)
 					continue;
-				auto balances = get_contract_balances(balance_change.address);
+				auto balances = read_contract_balances(writes, balance_change.address);
 				auto found_balance = false;
 				for (auto &balance : balances)
 				{
@@ -620,8 +1502,7 @@ namespace contract
 				}
 				std::string value;
 				auto contract_info_key = make_contract_info_key(balance_change.address);
-				auto status = _db->Get(read_options, contract_info_key, &value);
-				if (!status.ok()) {
+				if (!writes.get(contract_info_key, &value)) {
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to transfer balance"));
 				}
 				auto json_value = jsondiff::json_loads(value);
@@ -634,11 +1515,7 @@ namespace contract
 					balances_json_array.push_back(balance.to_json());
 				}
 				json_obj["balances"] = balances_json_array;
-				const auto& new_contract_info_value = jsondiff::json_dumps(json_obj);
-				auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-				if(!write_status.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-				changed_leveldb_keys.push_back(contract_info_key);
+				writes.put(contract_info_key, jsondiff::json_dumps(json_obj));
 			}
 			jsondiff::JsonDiff differ;
 			for (const auto &storage_change : changes->storage_changes)
@@ -646,45 +1523,11 @@ namespace contract
 				const auto &contract_id = storage_change.contract_id;
 				for (const auto &storage_change_item : storage_change.items)
 				{
-					const auto& storage_old_value = get_contract_storage(contract_id, storage_change_item.name);
-					const auto& storage_value = differ.patch(storage_old_value, storage_change_item.diff);
 					const auto& key = make_contract_storage_key(contract_id, storage_change_item.name);
-					auto status = _db->Put(write_options, key, jsondiff::json_dumps(storage_value));
-					if (!status.ok())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write to db error"));
-					changed_leveldb_keys.push_back(key);
-				}
-			}
-
-			// events save
-			auto transaction_events = std::make_shared<std::map<std::string, std::vector<ContractEventInfo>>>();
-			for (const auto& event_info : changes->events)
-			{
-				if (!event_info.transaction_id.empty()) {
-					if (transaction_events->find(event_info.transaction_id) == transaction_events->end()) {
-						(*transaction_events)[event_info.transaction_id] = std::vector<ContractEventInfo>();
-					}
-					(*transaction_events)[event_info.transaction_id].push_back(event_info);
-				}
-			}
-
-			// commitId=>events
-			{
-				const auto& commit_events_key = make_commit_events_key(commitId);
-				const auto& events_json = ContractChanges::events_to_json(changes->events);
-				if (!_db->Put(write_options, commit_events_key, jsondiff::json_dumps(events_json)).ok()) {
-					BOOST_THROW_EXCEPTION(ContractStorageException("commit events save error"));
-				}
-				changed_leveldb_keys.push_back(commit_events_key);
-			}
-			// transactionId=>events
-			for (const auto& p : *transaction_events) {
-				const auto& tx_events_key = make_transaction_events_key(p.first);
-				const auto& tx_events_json = ContractChanges::events_to_json(p.second);
-				if (!_db->Put(write_options, tx_events_key, jsondiff::json_dumps(tx_events_json)).ok()) {
-					BOOST_THROW_EXCEPTION(ContractStorageException("commit events save error"));
+					const auto& storage_old_value = read_json_value_or_null(writes, key);
+					const auto& storage_value = differ.patch(storage_old_value, storage_change_item.diff);
+					writes.put(key, jsondiff::json_dumps(storage_value));
 				}
-				changed_leveldb_keys.push_back(tx_events_key);
 			}
 
 			// upgrade infos
@@ -693,8 +1536,7 @@ namespace contract
 				const auto& contract_id = upgrade_info.contract_id;
 				std::string value;
 				auto contract_info_key = make_contract_info_key(contract_id);
-				auto status = _db->Get(read_options, contract_info_key, &value);
-				if (!status.ok()) {
+				if (!writes.get(contract_info_key, &value)) {
 					BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to upgrade"));
 				}
 				auto json_value = jsondiff::json_loads(value);
@@ -708,320 +1550,1396 @@ namespace contract
 					contract_info->name = differ.patch(contract_info->name, upgrade_info.name_diff).as_string();
 				if(upgrade_info.description_diff)
 					contract_info->description = differ.patch(contract_info->description, upgrade_info.description_diff).as_string();
-				const auto& new_contract_info_value = jsondiff::json_dumps(contract_info->to_json());
-				auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-				if (!write_status.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-				changed_leveldb_keys.push_back(contract_info_key);
+				writes.put(contract_info_key, jsondiff::json_dumps(contract_info->to_json()));
 
 				if (!old_contract_name.empty()) {
-					const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(old_contract_name);
-					auto delete_status = _db->Delete(write_options, contract_name_id_mapping_key);
-					if (!delete_status.ok() && !delete_status.IsNotFound())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-					changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+					writes.remove(make_contract_name_id_mapping_key(old_contract_name));
 				}
 				if (!contract_info->name.empty()) {
-					const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-					if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-						BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-					changed_leveldb_keys.push_back(contract_name_id_mapping_key);
+					writes.put(make_contract_name_id_mapping_key(contract_info->name), contract_info->id);
 				}
 			}
+		}
 
-			// save commit info
-			const auto& diff_json = changes->to_json();
-			const auto& diff_str = jsondiff::json_dumps(diff_json);
-			add_commit_info(commitId, CONTRACT_STORAGE_CHANGE_TYPE, diff_str, "");
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
-			success = true;
-			return commitId;
+		void ContractStorageService::prepare_contract_changes_parallel(std::vector<PreparedContractChanges>& prepared_list, const std::vector<size_t>& indexes) const
+		{
+			auto prepare_item = [&](size_t index) {
+				try
+				{
+					prepare_contract_changes(prepared_list[index]);
+				}
+				catch (...)
+				{
+					prepared_list[index].error = std::current_exception();
+				}
+			};
+			size_t threads_count = _options.commit_prepare_threads > 0 ? _options.commit_prepare_threads : std::thread::hardware_concurrency();
+			threads_count = std::min(threads_count, indexes.size());
+			if (threads_count <= 1)
+			{
+				for (auto index : indexes)
+					prepare_item(index);
+				return;
+			}
+			std::atomic<size_t> next(0);
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < threads_count; i++)
+			{
+				threads.push_back(std::thread([&]() {
+					size_t pos;
+					while ((pos = next++) < indexes.size())
+						prepare_item(indexes[pos]);
+				}));
+			}
+			for (auto& thread : threads)
+				thread.join();
 		}
 
-		ContractCommitId ContractStorageService::top_commit_id() const
+		ContractCommitId ContractStorageService::apply_prepared_contract_changes(PreparedContractChanges& prepared, std::vector<std::string>& changed_leveldb_keys)
 		{
-			check_db();
-			char *errMsg;
-			jsondiff::JsonArray records;
-			auto query_sql = "select id, commit_id, change_type, contract_id from commit_info order by id desc limit 1";
-			auto status = sqlite3_exec(_sql_db, query_sql,
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
+			auto& writes = *prepared.writes;
+			// changes prepared on a snapshot read newer state from now on
+			writes.set_snapshot(nullptr);
+			const auto& root_state_hash = generate_next_root_hash(_saved_root_state_hash, prepared.digest);
+			ContractCommitId commitId = root_state_hash.str();
+			const auto& saved_root_state_hash = saved_commit_id(root_state_hash);
+			update_state_tree(writes);
+			update_state_set_hash(writes);
+			// save commit info
+			auto commit_seq = add_commit_info(writes, commitId, saved_root_state_hash, CONTRACT_STORAGE_CHANGE_TYPE, prepared.diff_str, "");
+			// events are appended to the event log at the commit's seq, the undo record removes them
+			ContractEventLog::append(writes, commit_seq, prepared.changes->events);
+			add_event_blooms(writes, commit_seq, prepared.changes->events);
+			add_commit_undo_record(writes, saved_root_state_hash);
+			writes.put(root_state_hash_key, saved_root_state_hash);
+			writes.put(top_root_state_hash_key, saved_root_state_hash);
+			if (has_subscribers())
 			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				auto notification = make_commit_notification(writes);
+				notification->commit_id = commitId;
+				notification->commit_seq = commit_seq;
+				notification->block_height = _current_block_height;
+				notification->events = prepared.changes->events;
+				_pending_notifications.push_back(notification);
 			}
-			if (records.size() > 0)
-				return records[0]["commit_id"].as_string();
-			return EMPTY_COMMIT_ID;
+			write_changes(writes, changed_leveldb_keys);
+			return commitId;
 		}
 
-		ContractCommitId ContractStorageService::generate_next_root_hash(const std::string& old_root_state_hash, const fcrypto::sha256& diff_hash) const
+		void ContractStorageService::add_event_blooms(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events) const
 		{
-			return fcrypto::sha256::hash(old_root_state_hash + diff_hash.str() + std::to_string(_current_block_height)).str();
+			if (!events.empty())
+			{
+				ContractEventBloom bloom(events.size());
+				for (const auto& event_info : events)
+					bloom.add_event(event_info);
+				writes.put(ContractEventBloom::make_commit_key(commit_seq), bloom.bytes());
+			}
+			if (_options.event_bloom_range_blocks == 0)
+				return;
+			// open range is saved as "<range index>,<first commit seq>"
+			auto range_index = _current_block_height / _options.event_bloom_range_blocks;
+			std::string open_range;
+			if (writes.get(ContractEventBloom::open_range_key, &open_range))
+			{
+				std::vector<std::string> parts;
+				boost::split(parts, open_range, boost::is_any_of(","));
+				if (parts.size() != 2)
+					BOOST_THROW_EXCEPTION(ContractStorageException("event bloom open range format error"));
+				auto open_range_index = (uint32_t)std::stoul(parts[0]);
+				if (open_range_index == range_index)
+					return;
+				// block heights left the open range, so its commits are complete and read once from the event log
+				ContractEventRangeBloom range;
+				range.first_commit_seq = std::stoull(parts[1]);
+				range.last_commit_seq = commit_seq - 1;
+				size_t events_count = 0;
+				for (auto it = iterate_events(range.first_commit_seq, range.last_commit_seq); it->valid(); it->next())
+					events_count++;
+				range.bloom = ContractEventBloom(events_count);
+				for (auto it = iterate_events(range.first_commit_seq, range.last_commit_seq); it->valid(); it->next())
+					range.bloom.add_event(it->entry().event);
+				writes.put(ContractEventBloom::make_range_key(open_range_index), range.encode());
+			}
+			writes.put(ContractEventBloom::open_range_key, std::to_string(range_index) + "," + std::to_string(commit_seq));
 		}
 
-		void ContractStorageService::reset_root_state_hash(const ContractCommitId& dest_commit_id)
+		// save commit history with all diffs
+		ContractCommitId ContractStorageService::commit_contract_changes(ContractChangesP changes)
 		{
-			check_db();
-			auto commit_info = get_commit_info(dest_commit_id);
-			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
-				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
-			leveldb::WriteOptions write_options;
-			if (!_db->Put(write_options, root_state_hash_key, dest_commit_id).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
+			std::vector<ContractChangesP> changes_list;
+			changes_list.push_back(changes);
+			return commit_contract_changes_batch(changes_list)[0];
 		}
 
-		void ContractStorageService::rollback_to_root_state_hash_without_transactional(const ContractCommitId& dest_commit_id, std::vector<std::string>& changed_leveldb_keys)
+		std::vector<ContractCommitId> ContractStorageService::commit_contract_changes_batch(const std::vector<ContractChangesP>& changes_list)
 		{
 			check_db();
-			leveldb::WriteOptions write_options;
-			leveldb::ReadOptions read_options;
-			// find all commits after this commit
-			auto commit_info = get_commit_info(dest_commit_id);
-			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
-				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
-			char *errMsg;
-			jsondiff::JsonArray records;
-			std::string query_sql;
-			if (dest_commit_id == EMPTY_COMMIT_ID)
-				query_sql = "select id, commit_id, change_type, contract_id from commit_info order by id desc";
-			else
-				query_sql = std::string("select id, commit_id, change_type, contract_id from commit_info where id>") + std::to_string(commit_info->id) + " order by id desc";
-
-			auto status = sqlite3_exec(_sql_db, query_sql.c_str(),
-				&query_records_sql_callback, &records, &errMsg);
-			if (status != SQLITE_OK)
+			// the commits after root state hash and their checkpoints may be removed
+			if (!is_latest())
+				wait_background_checkpoint();
+			// snapshot leveldb for rollback
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			std::vector<std::string> changed_leveldb_keys;
+			// changes already committed after the reset root state hash only move the root state hash forward
+			std::vector<ContractCommitId> commit_ids;
+			size_t redone_count = 0;
+			while (redone_count < changes_list.size() && !changes_list[redone_count]->empty())
 			{
-				std::string err_msg_str(errMsg);
-				sqlite3_free(errMsg);
-				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				const auto& root_state_hash = current_root_state_hash();
+				const auto& next_commit_id = generate_next_root_hash(_saved_root_state_hash, hash_contract_changes(changes_list[redone_count])).str();
+				if (!redo_recorded_commit(root_state_hash, next_commit_id, changed_leveldb_keys))
+					break;
+				commit_ids.push_back(next_commit_id);
+				redone_count++;
 			}
-			std::vector<ContractCommitInfo> newerCommitInfos;
-			for (const auto &item_json : records)
-			{
-				jsondiff::JsonObject found_record = item_json.as<jsondiff::JsonObject>();
-				ContractCommitInfo commit_info;
-				commit_info.id = found_record["id"].as_uint64();
-				commit_info.commit_id = found_record["commit_id"].as_string();
-				commit_info.change_type = found_record["change_type"].as_string();
-				commit_info.contract_id = found_record["contract_id"].as_string();
-				newerCommitInfos.push_back(commit_info);
+			const auto& old_root_state_hash = current_root_state_hash();
+			if (!is_latest() && redone_count < changes_list.size()) {
+				rollback_to_root_state_hash_without_transactional(old_root_state_hash, changed_leveldb_keys);
+				assert(current_root_state_hash() == old_root_state_hash);
 			}
 
-			jsondiff::JsonDiff differ;
-
-			// rollback contracts info, contract balances, contract storages, upgrade infos and events
-			for (auto i = newerCommitInfos.begin(); i != newerCommitInfos.end(); i++)
+			// changes touching no key of former changes can be prepared on the same snapshot in parallel,
+			// others must be prepared after former changes applied
+			const auto prepare_snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(prepare_snapshot);
+			};
+			std::vector<PreparedContractChanges> prepared_list(changes_list.size());
+			std::vector<size_t> parallel_indexes;
+			std::set<std::string> touched_keys;
+			for (size_t i = redone_count; i < changes_list.size(); i++)
 			{
-				if (i->change_type == CONTRACT_INFO_CHANGE_TYPE)
+				auto& prepared = prepared_list[i];
+				prepared.changes = changes_list[i];
+				if (prepared.changes->empty())
+					continue;
+				const auto& key_set = contract_changes_key_set(*prepared.changes);
+				bool conflict = key_set.exclusive;
+				for (const auto& key : key_set.keys)
 				{
-					// contract info change rollback
-					auto diff_json = get_json_value_by_key_or_null(i->commit_id);
-					auto contract_info_diff = std::make_shared<jsondiff::DiffResult>(diff_json);
-					auto contract_info = get_contract_info(i->contract_id);
-					auto rollbakced_contract_info_json = differ.rollback(contract_info->to_json(), contract_info_diff);
-					auto rollbakced_contract_info = ContractInfo::from_json(rollbakced_contract_info_json);
-					if (!rollbakced_contract_info)
-					{
-						// delete this contract in db
-						const auto& delete_key = make_contract_info_key(i->contract_id);
-						auto delete_contract_status = _db->Delete(write_options, delete_key);
-						if (!delete_contract_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("delete contract info from db error"));
-						changed_leveldb_keys.push_back(delete_key);
-					}
-					else
-					{
-						// set older data
-						const auto& set_key = make_contract_info_key(i->contract_id);
-						auto update_status = _db->Put(write_options, set_key, jsondiff::json_dumps(rollbakced_contract_info->to_json()));
-						if (!update_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("rollback contract info to db error"));
-						changed_leveldb_keys.push_back(set_key);
-					}
-					if (contract_info && contract_info->name.size() > 0)
-					{
-						// when contract have name
-						if (!rollbakced_contract_info || rollbakced_contract_info->name.empty())
-						{
-							// when not have name before, delete name => id mapping
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-							if (!_db->Delete(write_options, contract_name_id_mapping_key).ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("rollback contract info(delete contract name=>id mapping) to db error"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
-						}
-					}
+					if (!touched_keys.insert(key).second)
+						conflict = true;
 				}
-				else if (i->change_type == CONTRACT_STORAGE_CHANGE_TYPE)
+				if (!conflict)
 				{
-					// contract balance and storage chagne rollback
-					auto diff_json = get_json_value_by_key_or_null(i->commit_id);
-					auto changes = ContractChanges::from_json(diff_json.as<jsondiff::JsonObject>());
-					for (const auto &balance_change : changes.balance_changes)
-					{
-						// balance change rollback
-						if (!balance_change.is_contract)
-							continue;
-						std::string value;
-						auto contract_info_key = make_contract_info_key(balance_change.address);
-						auto status = _db->Get(read_options, contract_info_key, &value);
-						if (!status.ok()) {
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to transfer balance"));
-						}
-						auto json_value = jsondiff::json_loads(value);
-						if (!json_value.is_object())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-						auto contract_info = ContractInfo::from_json(json_value);
-						auto balances = contract_info->balances;
-						auto found_balance = false;
-						for (auto &balance : balances)
-						{
-							if (balance.asset_id == balance_change.asset_id)
-							{
-								found_balance = true;
-								balance.amount = balance_change.add ? (balance.amount - balance_change.amount) : (balance.amount + balance_change.amount);
-								break;
-							}
-						}
-						if (!found_balance)
-						{
-							ContractBalance balance;
-							balance.amount = balance_change.add ? 0 : balance_change.amount;
-							balance.asset_id = balance_change.asset_id;
-							balances.push_back(balance);
-						}
-						contract_info->balances = balances;
-						auto new_contract_info_value = jsondiff::json_dumps(contract_info->to_json());
-						auto write_status = _db->Put(write_options, contract_info_key, new_contract_info_value);
-						if (!write_status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info write to db error"));
-						changed_leveldb_keys.push_back(contract_info_key);
+					prepared.writes = std::make_shared<ContractWriteSet>(_db, prepare_snapshot);
+					parallel_indexes.push_back(i);
+				}
+			}
+			prepare_contract_changes_parallel(prepared_list, parallel_indexes);
+
+			bool success = false;
+			begin_sql_transaction();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				if (success)
+				{
+					commit_sql_transaction();
+					publish_notifications();
+				}
+				else
+				{
+					_pending_notifications.clear();
+					rollback_sql_transaction();
+					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
+				}
+			};
+			ContractCommitId root_state_hash = old_root_state_hash;
+			for (size_t i = redone_count; i < prepared_list.size(); i++)
+			{
+				auto& prepared = prepared_list[i];
+				if (prepared.changes->empty()) {
+					commit_ids.push_back(root_state_hash);
+					continue;
+				}
+				if (prepared.error)
+					std::rethrow_exception(prepared.error);
+				if (!prepared.writes)
+				{
+					prepared.writes = std::make_shared<ContractWriteSet>(_db);
+					prepare_contract_changes(prepared);
+				}
+				root_state_hash = apply_prepared_contract_changes(prepared, changed_leveldb_keys);
+				commit_ids.push_back(root_state_hash);
+			}
+			if (root_state_hash != old_root_state_hash)
+			{
+				create_checkpoint_if_needed(root_state_hash);
+				finalize_old_blocks_if_needed();
+			}
+			success = true;
+			return commit_ids;
+		}
+
+		ContractCommitId ContractStorageService::top_commit_id() const
+		{
+			check_db();
+			auto top = _commit_index.top();
+			return top ? top->commit_id : EMPTY_COMMIT_ID;
+		}
+
+		fcrypto::sha256 ContractStorageService::generate_next_root_hash(const std::string& saved_old_root_state_hash, const fcrypto::sha256& diff_hash) const
+		{
+			return chain_commit_id(saved_old_root_state_hash, diff_hash, _current_block_height);
+		}
+
+		fcrypto::sha256 ContractStorageService::chain_commit_id(const std::string& saved_old_root_state_hash, const fcrypto::sha256& diff_hash, uint32_t block_height) const
+		{
+			// saved hex ids are the hex ids themselves
+			if (!uses_binary_commit_ids())
+				return fcrypto::sha256::hash(saved_old_root_state_hash + diff_hash.str() + std::to_string(block_height));
+			// raw old root + raw diff hash + 4 bytes big endian block height
+			char block_height_bytes[4];
+			for (size_t i = 0; i < sizeof(block_height_bytes); i++)
+				block_height_bytes[i] = (char)(block_height >> (24 - 8 * i));
+			fcrypto::sha256::encoder enc;
+			enc.write(saved_old_root_state_hash.data(), (uint32_t)saved_old_root_state_hash.size());
+			enc.write(diff_hash.data(), commit_id_bytes_size);
+			enc.write(block_height_bytes, sizeof(block_height_bytes));
+			return enc.result();
+		}
+
+		bool ContractStorageService::uses_binary_commit_ids() const
+		{
+			if (_commit_id_format_loaded)
+				return _binary_commit_ids;
+			// not decided before the first commit
+			return _options.binary_commit_ids;
+		}
+
+		std::string ContractStorageService::saved_commit_id(const ContractCommitId& commit_id) const
+		{
+			return saved_commit_id_of_format(commit_id, uses_binary_commit_ids());
+		}
+
+		std::string ContractStorageService::saved_commit_id(const fcrypto::sha256& commit_id) const
+		{
+			if (!uses_binary_commit_ids())
+				return commit_id.str();
+			return std::string(commit_id.data(), commit_id_bytes_size);
+		}
+
+		ContractCommitId ContractStorageService::commit_id_from_saved(const std::string& saved) const
+		{
+			if (!uses_binary_commit_ids() || saved.size() != commit_id_bytes_size)
+				return saved;
+			return bytes_to_hex(saved);
+		}
+
+		std::string ContractStorageService::commit_id_sql_value(const ContractCommitId& commit_id) const
+		{
+			const auto& saved = saved_commit_id(commit_id);
+			if (saved.size() == commit_id_bytes_size && uses_binary_commit_ids())
+				return std::string("X'") + bytes_to_hex(saved) + "'";
+			return std::string("'") + commit_id + "'";
+		}
+
+		std::string ContractStorageService::commit_id_sql_column() const
+		{
+			return commit_id_sql_column_of_format(uses_binary_commit_ids());
+		}
+
+		void ContractStorageService::reset_root_state_hash(const ContractCommitId& dest_commit_id)
+		{
+			check_db();
+			auto commit_info = get_commit_info(dest_commit_id);
+			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			check_not_finalized(commit_info ? commit_info->id : 0, dest_commit_id);
+			leveldb::WriteOptions write_options;
+			const auto& saved_dest_commit_id = saved_commit_id(dest_commit_id);
+			if (!_db->Put(write_options, root_state_hash_key, saved_dest_commit_id).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
+			_saved_root_state_hash = saved_dest_commit_id;
+		}
+
+		bool ContractStorageService::redo_recorded_commit(const ContractCommitId& root_state_hash, const ContractCommitId& next_commit_id, std::vector<std::string>& changed_leveldb_keys)
+		{
+			if (is_latest())
+				return false;
+			// commit ids are chained, so a recorded commit with this id after root must be the root's next commit
+			auto next_commit_info = get_commit_info(next_commit_id);
+			if (!next_commit_info)
+				return false;
+			if (root_state_hash != EMPTY_COMMIT_ID)
+			{
+				auto root_commit_info = get_commit_info(root_state_hash);
+				if (!root_commit_info || next_commit_info->id <= root_commit_info->id)
+					return false;
+			}
+			leveldb::WriteOptions write_options;
+			changed_leveldb_keys.push_back(root_state_hash_key);
+			const auto& saved_next_commit_id = saved_commit_id(next_commit_id);
+			if (!_db->Put(write_options, root_state_hash_key, saved_next_commit_id).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
+			_saved_root_state_hash = saved_next_commit_id;
+			return true;
+		}
+
+		void ContractStorageService::fast_forward(const ContractCommitId& dest_commit_id)
+		{
+			check_db();
+			const auto& root_state_hash = current_root_state_hash();
+			if (dest_commit_id == root_state_hash)
+				return;
+			auto commit_info = get_commit_info(dest_commit_id);
+			if (!commit_info)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			if (root_state_hash != EMPTY_COMMIT_ID)
+			{
+				auto root_commit_info = get_commit_info(root_state_hash);
+				if (root_commit_info && commit_info->id <= root_commit_info->id)
+					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("commit ") + dest_commit_id + " is not after current root state hash"));
+			}
+			leveldb::WriteOptions write_options;
+			const auto& saved_dest_commit_id = saved_commit_id(dest_commit_id);
+			if (!_db->Put(write_options, root_state_hash_key, saved_dest_commit_id).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
+			_saved_root_state_hash = saved_dest_commit_id;
+		}
+
+		std::vector<ContractCommitInfo> ContractStorageService::get_commits_after(uint64_t commit_seq) const
+		{
+			check_db();
+			return _commit_index.after(commit_seq);
+		}
+
+		std::vector<ContractCommitInfo> ContractStorageService::get_contract_commits(const AddressType& contract_id, uint64_t from_commit_seq, size_t limit) const
+		{
+			auto sql_condition = std::string("where id in (select commit_seq from commit_contracts where contract_id='") + contract_id + "' and commit_seq>=" + std::to_string(from_commit_seq) + ") order by id";
+			if (limit > 0)
+				sql_condition += " limit " + std::to_string(limit);
+			return query_commit_infos(sql_condition);
+		}
+
+		ContractCommitsSummary ContractStorageService::summarize_commits(uint32_t from_block_height, uint32_t to_block_height) const
+		{
+			check_db();
+			jsondiff::JsonArray records;
+			exec_sql(_sql_db, std::string("select count(*) as commits_count, sum(keys_written) as keys_written, sum(diff_size) as diff_size from commit_info where block_height>=")
+				+ std::to_string(from_block_height) + " and block_height<=" + std::to_string(to_block_height), &records);
+			ContractCommitsSummary summary;
+			if (records.empty())
+				return summary;
+			auto record = records[0].as<jsondiff::JsonObject>();
+			summary.commits_count = record["commits_count"].as_uint64();
+			// sum is null when no commit is found
+			if (record["keys_written"].is_null())
+				return summary;
+			summary.keys_written = record["keys_written"].as_uint64();
+			summary.diff_size = record["diff_size"].as_uint64();
+			return summary;
+		}
+
+		std::vector<ContractCommitInfo> ContractStorageService::query_commit_infos(const std::string& sql_condition) const
+		{
+			std::vector<ContractCommitInfo> commit_infos;
+			scan_commit_infos(sql_condition, [&](const ContractCommitInfo& commit_info) {
+				commit_infos.push_back(commit_info);
+			});
+			return commit_infos;
+		}
+
+		static std::string sql_column_text(sqlite3_stmt* stmt, int column)
+		{
+			auto text = sqlite3_column_text(stmt, column);
+			if (!text)
+				return "";
+			return std::string((const char*)text, (size_t)sqlite3_column_bytes(stmt, column));
+		}
+
+		void ContractStorageService::scan_commit_infos(const std::string& sql_condition, const std::function<void(const ContractCommitInfo&)>& visitor) const
+		{
+			check_db();
+			auto query_sql = std::string("select id, ") + commit_id_sql_column() + ", change_type, contract_id, block_height, state_root, keys_written, diff_size from commit_info " + sql_condition;
+			sqlite3_stmt* stmt = nullptr;
+			if (sqlite3_prepare_v2(_sql_db, query_sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+				BOOST_THROW_EXCEPTION(ContractStorageException(sqlite3_errmsg(_sql_db)));
+			BOOST_SCOPE_EXIT_ALL(&) {
+				sqlite3_finalize(stmt);
+			};
+			ContractCommitInfo commit_info;
+			int status;
+			while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+			{
+				commit_info.id = (uint64_t)sqlite3_column_int64(stmt, 0);
+				commit_info.commit_id = sql_column_text(stmt, 1);
+				commit_info.change_type = sql_column_text(stmt, 2);
+				commit_info.contract_id = sql_column_text(stmt, 3);
+				commit_info.block_height = (uint32_t)sqlite3_column_int64(stmt, 4);
+				commit_info.state_root = sql_column_text(stmt, 5);
+				commit_info.keys_written = (uint64_t)sqlite3_column_int64(stmt, 6);
+				commit_info.diff_size = (uint64_t)sqlite3_column_int64(stmt, 7);
+				visitor(commit_info);
+			}
+			if (status != SQLITE_DONE)
+				BOOST_THROW_EXCEPTION(ContractStorageException(sqlite3_errmsg(_sql_db)));
+		}
+
+		bool ContractStorageService::collect_commit_rollback(const ContractCommitInfo& commit_info, ContractWriteSet& writes) const
+		{
+			jsondiff::JsonDiff differ;
+			// rollback contracts info, contract balances, contract storages, upgrade infos and events
+			const auto& commit_key = saved_commit_id(commit_info.commit_id);
+			const auto& undo_key = make_commit_undo_key(commit_key);
+			std::string undo_record;
+			bool restored_from_undo_record = writes.get(undo_key, &undo_record);
+			if (restored_from_undo_record)
+			{
+				// older commits are visited later, so each key ends with its earliest pre-image in the range
+				for (const auto& item : decode_undo_items(undo_record))
+				{
+					if (item.existed)
+						writes.put(item.key, item.value);
+					else
+						writes.remove(item.key);
+				}
+				writes.remove(undo_key);
+			}
+			else if (commit_info.change_type == CONTRACT_INFO_CHANGE_TYPE)
+			{
+				// commits without undo record replay their diff on the pending state
+				// contract info change rollback
+				auto diff_json = read_json_value_or_null(writes, commit_key);
+				auto contract_info_diff = std::make_shared<jsondiff::DiffResult>(diff_json);
+				auto contract_info = read_contract_info(writes, commit_info.contract_id);
+				auto rollbakced_contract_info_json = differ.rollback(contract_info->to_json(), contract_info_diff);
+				auto rollbakced_contract_info = ContractInfo::from_json(rollbakced_contract_info_json);
+				if (!rollbakced_contract_info)
+				{
+					// delete this contract in db
+					writes.remove(make_contract_info_key(commit_info.contract_id));
+				}
+				else
+				{
+					// set older data
+					writes.put(make_contract_info_key(commit_info.contract_id), jsondiff::json_dumps(rollbakced_contract_info->to_json()));
+				}
+				if (contract_info && contract_info->name.size() > 0)
+				{
+					// when contract have name
+					if (!rollbakced_contract_info || rollbakced_contract_info->name.empty())
+					{
+						// when not have name before, delete name => id mapping
+						writes.remove(make_contract_name_id_mapping_key(contract_info->name));
+					}
+				}
+			}
+			else if (commit_info.change_type == CONTRACT_STORAGE_CHANGE_TYPE)
+			{
+				// contract balance and storage chagne rollback
+				auto diff_json = read_json_value_or_null(writes, commit_key);
+				auto changes = ContractChanges::from_json(diff_json.as<jsondiff::JsonObject>());
+				for (const auto &balance_change : changes.balance_changes)
+				{
+					// balance change rollback
+					if (!balance_change.is_contract)
+						continue;
+					auto contract_info_key = make_contract_info_key(balance_change.address);
+					auto contract_info = read_contract_info(writes, balance_change.address);
+					if (!contract_info) {
+						BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to transfer balance"));
 					}
-					for (const auto &storage_change : changes.storage_changes)
+					auto balances = contract_info->balances;
+					auto found_balance = false;
+					for (auto &balance : balances)
 					{
-						// storage change rollback
-						const auto &contract_id = storage_change.contract_id;
-						for (const auto &storage_change_item : storage_change.items)
+						if (balance.asset_id == balance_change.asset_id)
 						{
-							auto storage_new_value = get_contract_storage(contract_id, storage_change_item.name);
-							auto storage_value = differ.rollback(storage_new_value, storage_change_item.diff);
-							auto key = make_contract_storage_key(contract_id, storage_change_item.name);
-							auto status = _db->Put(write_options, key, jsondiff::json_dumps(storage_value));
-							if (!status.ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract storage write to db error"));
-							changed_leveldb_keys.push_back(key);
+							found_balance = true;
+							balance.amount = balance_change.add ? (balance.amount - balance_change.amount) : (balance.amount + balance_change.amount);
+							break;
 						}
 					}
-					for (const auto& upgrade_info : changes.upgrade_infos)
+					if (!found_balance)
 					{
-						const auto& contract_id = upgrade_info.contract_id;
-						std::string value;
-						auto contract_info_key = make_contract_info_key(contract_id);
-						auto status = _db->Get(read_options, contract_info_key, &value);
-						if (!status.ok()) {
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to rollback upgrade"));
-						}
-						auto json_value = jsondiff::json_loads(value);
-						if (!json_value.is_object())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract info db data error"));
-						auto contract_info = ContractInfo::from_json(json_value);
-						auto now_contract_name(contract_info->name);
-						jsondiff::JsonValue old_contract_name;
-						if (upgrade_info.name_diff)
-							old_contract_name = differ.rollback(contract_info->name, upgrade_info.name_diff);
-						else
-							old_contract_name = contract_info->name;
-						contract_info->name = old_contract_name.is_string() ? old_contract_name.as_string() : "";
-						jsondiff::JsonValue old_contract_desc;
-						if (upgrade_info.description_diff)
-							old_contract_desc = differ.rollback(contract_info->description, upgrade_info.description_diff);
-						else
-							old_contract_desc = contract_info->description;
-						contract_info->description = old_contract_desc.is_string() ? old_contract_desc.as_string() : "";
-						status = _db->Put(write_options, contract_info_key, jsondiff::json_dumps(contract_info->to_json()));
-						if (!status.ok())
-							BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-						changed_leveldb_keys.push_back(contract_info_key);
-						// mapping name=>id
-						if (!now_contract_name.empty()) {
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(now_contract_name);
-							auto delete_status = _db->Delete(write_options, contract_name_id_mapping_key);
-							if (!delete_status.ok() && !delete_status.IsNotFound())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
-						}
-						if (!contract_info->name.empty()) {
-							const auto& contract_name_id_mapping_key = make_contract_name_id_mapping_key(contract_info->name);
-							if (!_db->Put(write_options, contract_name_id_mapping_key, contract_info->id).ok())
-								BOOST_THROW_EXCEPTION(ContractStorageException("contract upgrade info rollback failed"));
-							changed_leveldb_keys.push_back(contract_name_id_mapping_key);
-						}
+						ContractBalance balance;
+						balance.amount = balance_change.add ? 0 : balance_change.amount;
+						balance.asset_id = balance_change.asset_id;
+						balances.push_back(balance);
+					}
+					contract_info->balances = balances;
+					writes.put(contract_info_key, jsondiff::json_dumps(contract_info->to_json()));
+				}
+				for (const auto &storage_change : changes.storage_changes)
+				{
+					// storage change rollback
+					const auto &contract_id = storage_change.contract_id;
+					for (const auto &storage_change_item : storage_change.items)
+					{
+						auto key = make_contract_storage_key(contract_id, storage_change_item.name);
+						auto storage_new_value = read_json_value_or_null(writes, key);
+						auto storage_value = differ.rollback(storage_new_value, storage_change_item.diff);
+						writes.put(key, jsondiff::json_dumps(storage_value));
 					}
+				}
+				for (const auto& upgrade_info : changes.upgrade_infos)
+				{
+					const auto& contract_id = upgrade_info.contract_id;
+					auto contract_info_key = make_contract_info_key(contract_id);
+					auto contract_info = read_contract_info(writes, contract_id);
+					if (!contract_info) {
+						BOOST_THROW_EXCEPTION(ContractStorageException("contract info not found to rollback upgrade"));
+					}
+					auto now_contract_name(contract_info->name);
+					jsondiff::JsonValue old_contract_name;
+					if (upgrade_info.name_diff)
+						old_contract_name = differ.rollback(contract_info->name, upgrade_info.name_diff);
+					else
+						old_contract_name = contract_info->name;
+					contract_info->name = old_contract_name.is_string() ? old_contract_name.as_string() : "";
+					jsondiff::JsonValue old_contract_desc;
+					if (upgrade_info.description_diff)
+						old_contract_desc = differ.rollback(contract_info->description, upgrade_info.description_diff);
+					else
+						old_contract_desc = contract_info->description;
+					contract_info->description = old_contract_desc.is_string() ? old_contract_desc.as_string() : "";
+					writes.put(contract_info_key, jsondiff::json_dumps(contract_info->to_json()));
+					// mapping name=>id
+					if (!now_contract_name.empty()) {
+						writes.remove(make_contract_name_id_mapping_key(now_contract_name));
+					}
+					if (!contract_info->name.empty()) {
+						writes.put(make_contract_name_id_mapping_key(contract_info->name), contract_info->id);
+					}
+				}
+				ContractEventLog::remove(writes, commit_info.id, changes.events);
+				if (!changes.events.empty())
+					writes.remove(ContractEventBloom::make_commit_key(commit_info.id));
+				// events saved as json arrays before the event log
+				std::string legacy_events;
+				if (writes.get(make_commit_events_key(commit_key), &legacy_events))
+				{
 					std::set<std::string> transaction_ids;
 					for (const auto& event_info : changes.events) {
 						if (!event_info.transaction_id.empty()) {
 							transaction_ids.insert(event_info.transaction_id);
 						}
 					}
+					// transactionId=>events delete
+					for (const auto& txid : transaction_ids) {
+						writes.remove(make_transaction_events_key(txid));
+					}
+					// events key delete
+					writes.remove(make_commit_events_key(commit_key));
+				}
+			}
+			else
+			{
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not supported change type ") + commit_info.change_type));
+			}
+			// delete the rollbackedCommitId => value in db
+			writes.remove(commit_key);
+			return !restored_from_undo_record;
+		}
+
+		uint64_t ContractStorageService::get_rollback_dest_seq(const ContractCommitId& dest_commit_id) const
+		{
+			auto commit_info = get_commit_info(dest_commit_id);
+			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			uint64_t dest_commit_seq = commit_info ? commit_info->id : 0;
+			check_not_finalized(dest_commit_seq, dest_commit_id);
+			return dest_commit_seq;
+		}
+
+		ContractRollbackEstimate ContractStorageService::estimate_rollback(const ContractCommitId& dest_commit_id) const
+		{
+			check_db();
+			const auto& commit_infos = get_commits_after(get_rollback_dest_seq(dest_commit_id));
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = snapshot;
+			read_options.fill_cache = false;
+			// key => bytes written when restoring it
+			std::map<std::string, uint64_t> key_bytes;
+			for (const auto& commit_info : commit_infos)
+			{
+				const auto& commit_key = saved_commit_id(commit_info.commit_id);
+				const auto& undo_key = make_commit_undo_key(commit_key);
+				std::string undo_record;
+				if (!_db->Get(read_options, undo_key, &undo_record).ok())
+				{
+					// commits without undo record are only known by replaying their diffs
+					return dry_run_rollback(dest_commit_id).estimate;
+				}
+				for (const auto& item : decode_undo_items(undo_record))
+				{
+					key_bytes[item.key] = item.key.size() + item.value.size();
+				}
+				key_bytes[undo_key] = undo_key.size();
+				key_bytes[commit_key] = commit_key.size();
+			}
+			const auto& saved_dest_commit_id = saved_commit_id(dest_commit_id);
+			key_bytes[root_state_hash_key] = root_state_hash_key.size() + saved_dest_commit_id.size();
+			key_bytes[top_root_state_hash_key] = top_root_state_hash_key.size() + saved_dest_commit_id.size();
+			ContractRollbackEstimate estimate;
+			estimate.commits_count = commit_infos.size();
+			estimate.keys_count = key_bytes.size();
+			for (const auto& p : key_bytes)
+			{
+				estimate.bytes += p.second;
+			}
+			return estimate;
+		}
+
+		ContractRollbackDryRun ContractStorageService::dry_run_rollback(const ContractCommitId& dest_commit_id) const
+		{
+			check_db();
+			const auto& commit_infos = get_commits_after(get_rollback_dest_seq(dest_commit_id));
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			ContractWriteSet writes(_db, snapshot);
+			bool state_tree_stale = false;
+			for (const auto& commit_info : commit_infos)
+			{
+				if (collect_commit_rollback(commit_info, writes))
+					state_tree_stale = true;
+			}
+			if (state_tree_stale)
+			{
+				update_state_tree(writes);
+				update_state_set_hash(writes);
+			}
+			writes.put(root_state_hash_key, saved_commit_id(dest_commit_id));
+			writes.put(top_root_state_hash_key, saved_commit_id(dest_commit_id));
+
+			ContractRollbackDryRun result;
+			result.root_state_hash = dest_commit_id;
+			result.state_root = state_tree_root(writes);
+			result.estimate.commits_count = commit_infos.size();
+			for (const auto& p : writes.items())
+			{
+				result.changed_keys.push_back(p.first);
+				result.estimate.bytes += p.first.size() + p.second.value.size();
+			}
+			result.estimate.keys_count = result.changed_keys.size();
+			return result;
+		}
+
+		void ContractStorageService::rollback_to_root_state_hash_without_transactional(const ContractCommitId& dest_commit_id, std::vector<std::string>& changed_leveldb_keys)
+		{
+			check_db();
+			auto changed_keys_begin = changed_leveldb_keys.size();
+			// find all commits after this commit
+			auto dest_commit_seq = get_rollback_dest_seq(dest_commit_id);
+			// a checkpoint near dest commit replaces rollbacking most of the newer commits
+			restore_nearest_checkpoint(dest_commit_seq, changed_leveldb_keys);
+			auto newerCommitInfos = get_commits_after(dest_commit_seq);
+
+			// the net change of every key over all rollbacked commits is collected first and written in one batch
+			ContractWriteSet writes(_db);
+			ContractRollbackStats stats;
+			// undo records restore state tree nodes and state set hash too, commits replaying diffs need them updated
+			bool state_tree_stale = false;
+
+			for (auto i = newerCommitInfos.begin(); i != newerCommitInfos.end(); i++)
+			{
+				if (collect_commit_rollback(*i, writes))
+					state_tree_stale = true;
+				stats.commits_count++;
+
+				if (!_options.coalesce_rollback_writes)
+				{
+					if (state_tree_stale)
 					{
-						// transactionId=>events delete
-						for (const auto& txid : transaction_ids) {
-							const auto& tx_events_key = make_transaction_events_key(txid);
-							auto status = _db->Delete(write_options, tx_events_key);
-							if (!status.ok() && !status.IsNotFound()) {
-								BOOST_THROW_EXCEPTION(ContractStorageException("rollback commit events failed"));
-							}
-							if (status.ok())
-								changed_leveldb_keys.push_back(tx_events_key);
-						}
+						update_state_tree(writes);
+						update_state_set_hash(writes);
 					}
+					state_tree_stale = false;
+					stats.key_writes += writes.write_count();
+					stats.keys_written += writes.items().size();
+					write_changes(writes, changed_leveldb_keys);
+					writes.clear();
+				}
+			}
+
+			if (state_tree_stale)
+			{
+				update_state_tree(writes);
+				update_state_set_hash(writes);
+			}
+			const auto& root_state_hash = saved_commit_id(dest_commit_id);
+			writes.put(root_state_hash_key, root_state_hash);
+			writes.put(top_root_state_hash_key, root_state_hash);
+			stats.key_writes += writes.write_count();
+			stats.keys_written += writes.items().size();
+			write_changes(writes, changed_leveldb_keys);
+			// all rollbacked commits are newer than dest commit
+			exec_sql_with_seq(_sql_db, "delete from commit_info where id>?1", dest_commit_seq);
+			exec_sql_with_seq(_sql_db, "delete from commit_contracts where commit_seq>?1", dest_commit_seq);
+			_commit_index.remove_after(dest_commit_seq);
+			_sql_transaction_removed_commits = true;
+			_last_rollback_stats = stats;
+			remove_checkpoints_after(dest_commit_seq);
+			if (has_subscribers())
+			{
+				auto notification = std::make_shared<ContractCommitNotification>();
+				notification->is_rollback = true;
+				notification->commit_id = dest_commit_id;
+				notification->commit_seq = dest_commit_seq;
+				notification->block_height = _current_block_height;
+				std::set<std::string> changed_keys(changed_leveldb_keys.begin() + changed_keys_begin, changed_leveldb_keys.end());
+				for (const auto& key : changed_keys)
+				{
+					if (is_state_set_key(key))
+						add_changed_state_key(*notification, key);
+				}
+				_pending_notifications.push_back(notification);
+			}
+		}
+
+		static const size_t checkpoint_write_batch_bytes = 4 * 1024 * 1024;
+
+		static ContractCheckpointInfo checkpoint_info_from_record(const jsondiff::JsonObject& record)
+		{
+			ContractCheckpointInfo checkpoint;
+			checkpoint.id = record["id"].as_uint64();
+			checkpoint.commit_seq = record["commit_seq"].as_uint64();
+			checkpoint.commit_id = record["commit_id"].as_string();
+			checkpoint.block_height = (uint32_t)record["block_height"].as_uint64();
+			checkpoint.keys_count = record["keys_count"].as_uint64();
+			checkpoint.path = record["path"].as_string();
+			return checkpoint;
+		}
+
+		static std::vector<ContractCheckpointInfo> query_checkpoints(sqlite3* sql_db)
+		{
+			char *errMsg;
+			jsondiff::JsonArray records;
+			auto status = sqlite3_exec(sql_db, "select id, commit_seq, commit_id, block_height, keys_count, path from commit_checkpoint order by commit_seq asc",
+				&query_records_sql_callback, &records, &errMsg);
+			if (status != SQLITE_OK)
+			{
+				std::string err_msg_str(errMsg);
+				sqlite3_free(errMsg);
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+			}
+			std::vector<ContractCheckpointInfo> checkpoints;
+			for (const auto& record : records)
+			{
+				checkpoints.push_back(checkpoint_info_from_record(record.as<jsondiff::JsonObject>()));
+			}
+			return checkpoints;
+		}
+
+		std::vector<ContractCheckpointInfo> ContractStorageService::get_checkpoints() const
+		{
+			check_db();
+			return query_checkpoints(_sql_db);
+		}
+
+		uint64_t ContractStorageService::top_commit_seq() const
+		{
+			check_db();
+			auto top = _commit_index.top();
+			return top ? top->id : 0;
+		}
+
+		void ContractStorageService::create_checkpoint()
+		{
+			check_db();
+			if (!is_latest())
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't create checkpoint when root state hash reset"));
+			auto commit_info = get_commit_info(current_root_state_hash());
+			if (!commit_info)
+				BOOST_THROW_EXCEPTION(ContractStorageException("can't create checkpoint before any commit"));
+			wait_background_checkpoint();
+			const auto snapshot = _db->GetSnapshot();
+			BOOST_SCOPE_EXIT_ALL(&) {
+				_db->ReleaseSnapshot(snapshot);
+			};
+			create_checkpoint_of_commit(_sql_db, *commit_info, snapshot, _options.max_checkpoints);
+		}
+
+		void ContractStorageService::create_checkpoint_if_needed(const ContractCommitId& commit_id)
+		{
+			if (_options.checkpoint_interval_blocks == 0 || _checkpoint_building)
+				return;
+			const auto& checkpoints = get_checkpoints();
+			if (!checkpoints.empty() && _current_block_height < checkpoints.back().block_height + _options.checkpoint_interval_blocks)
+				return;
+			auto commit_info = get_commit_info(commit_id);
+			if (commit_info)
+				_pending_checkpoint = std::make_shared<ContractCommitInfo>(*commit_info);
+		}
+
+		void ContractStorageService::start_background_checkpoint(const ContractCommitInfo& commit_info)
+		{
+			wait_background_checkpoint();
+			// state after the commit, later commits don't change the snapshot
+			const auto snapshot = _db->GetSnapshot();
+			auto max_checkpoints = _options.max_checkpoints;
+			auto sqlite_options = _options.sqlite;
+			_checkpoint_building = true;
+			_checkpoint_thread = std::thread([this, commit_info, snapshot, max_checkpoints, sqlite_options]() {
+				BOOST_SCOPE_EXIT_ALL(&) {
+					_db->ReleaseSnapshot(snapshot);
+					_checkpoint_building = false;
+				};
+				sqlite3* sql_db = nullptr;
+				if (sqlite3_open(_storage_sql_db_path.c_str(), &sql_db) != SQLITE_OK)
+				{
+					sqlite3_close(sql_db);
+					return;
+				}
+				BOOST_SCOPE_EXIT_ALL(&) {
+					sqlite3_close(sql_db);
+				};
+				try
+				{
+					apply_sqlite_options(sql_db, sqlite_options);
+					create_checkpoint_of_commit(sql_db, commit_info, snapshot, max_checkpoints);
+				}
+				catch (...)
+				{
+					// checkpoint is created again by a later commit
+				}
+			});
+		}
+
+		void ContractStorageService::wait_background_checkpoint()
+		{
+			if (_checkpoint_thread.joinable())
+				_checkpoint_thread.join();
+		}
+
+		void ContractStorageService::create_checkpoint_of_commit(sqlite3* sql_db, const ContractCommitInfo& commit_info, const leveldb::Snapshot* snapshot, size_t max_checkpoints) const
+		{
+			const auto& path = _storage_db_path + "_checkpoint_" + std::to_string(commit_info.id);
+			leveldb::Options options;
+			options.create_if_missing = true;
+			// image left by a rollbacked commit with same seq
+			leveldb::DestroyDB(path, options);
+			leveldb::DB* checkpoint_db = nullptr;
+			if (!leveldb::DB::Open(options, path, &checkpoint_db).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("create checkpoint db ") + path + " error"));
+			bool success = false;
+			BOOST_SCOPE_EXIT_ALL(&) {
+				delete checkpoint_db;
+				if (!success)
+					leveldb::DestroyDB(path, leveldb::Options());
+			};
+
+			// copy all keys of a consistent snapshot
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = snapshot;
+			read_options.fill_cache = false;
+			leveldb::WriteOptions write_options;
+			std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(read_options));
+			leveldb::WriteBatch batch;
+			uint64_t keys_count = 0;
+			for (it->SeekToFirst(); it->Valid(); it->Next())
+			{
+				batch.Put(it->key(), it->value());
+				keys_count++;
+				if (batch.ApproximateSize() >= checkpoint_write_batch_bytes)
+				{
+					if (!checkpoint_db->Write(write_options, &batch).ok())
+						BOOST_THROW_EXCEPTION(ContractStorageException("write checkpoint error"));
+					batch.Clear();
+				}
+			}
+			if (!it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("read state for checkpoint error"));
+			write_options.sync = true;
+			if (!checkpoint_db->Write(write_options, &batch).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("write checkpoint error"));
+
+			// the commit may be rollbacked while copying
+			exec_sql(sql_db, std::string("insert into commit_checkpoint (commit_seq, commit_id, block_height, keys_count, path) select ") + std::to_string(commit_info.id)
+				+ ",'" + commit_info.commit_id + "'," + std::to_string(commit_info.block_height) + "," + std::to_string(keys_count) + ",'" + path
+				+ "' where exists (select 1 from commit_info where id=" + std::to_string(commit_info.id) + " and commit_id=" + commit_id_sql_value(commit_info.commit_id) + ")");
+			if (sqlite3_changes(sql_db) == 0)
+				return;
+			success = true;
+
+			// remove oldest checkpoints
+			auto checkpoints = query_checkpoints(sql_db);
+			for (size_t i = 0; i + max_checkpoints < checkpoints.size(); i++)
+			{
+				exec_sql(sql_db, std::string("delete from commit_checkpoint where id=") + std::to_string(checkpoints[i].id));
+				leveldb::DestroyDB(checkpoints[i].path, leveldb::Options());
+			}
+		}
+
+		void ContractStorageService::remove_checkpoints_after(uint64_t commit_seq)
+		{
+			check_db();
+			for (const auto& checkpoint : get_checkpoints())
+			{
+				if (checkpoint.commit_seq <= commit_seq)
+					continue;
+				char *err_msg;
+				auto delete_sql = std::string("delete from commit_checkpoint where id=") + std::to_string(checkpoint.id);
+				if (sqlite3_exec(_sql_db, delete_sql.c_str(), &empty_sql_callback, nullptr, &err_msg) != SQLITE_OK)
+				{
+					std::string err_msg_str(err_msg);
+					sqlite3_free(err_msg);
+					BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+				}
+				remove_checkpoint_db(checkpoint.path);
+			}
+		}
+
+		void ContractStorageService::remove_checkpoint_db(const std::string& path)
+		{
+			// a rollbacked transaction brings the checkpoint row back, so the db must still exist
+			if (_sql_transaction_open)
+				_pending_checkpoint_removals.push_back(path);
+			else
+				leveldb::DestroyDB(path, leveldb::Options());
+		}
+
+		bool ContractStorageService::restore_nearest_checkpoint(uint64_t dest_commit_seq, std::vector<std::string>& changed_leveldb_keys)
+		{
+			check_db();
+			auto top_seq = top_commit_seq();
+			ContractCheckpointInfo nearest_checkpoint;
+			bool found = false;
+			for (const auto& checkpoint : get_checkpoints())
+			{
+				if (checkpoint.commit_seq >= dest_commit_seq && checkpoint.commit_seq < top_seq)
+				{
+					nearest_checkpoint = checkpoint;
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				return false;
+			// restoring rewrites about all keys of the checkpoint, then the commits between dest and checkpoint are rollbacked as usual
+			auto replay_cost = (top_seq - dest_commit_seq) * _options.rollback_keys_per_commit;
+			auto restore_cost = nearest_checkpoint.keys_count + (nearest_checkpoint.commit_seq - dest_commit_seq) * _options.rollback_keys_per_commit;
+			if (restore_cost >= replay_cost)
+				return false;
+			leveldb::DB* checkpoint_db = nullptr;
+			if (!leveldb::DB::Open(leveldb::Options(), nearest_checkpoint.path, &checkpoint_db).ok())
+				return false;
+			std::unique_ptr<leveldb::DB> checkpoint_db_holder(checkpoint_db);
+
+			// merge the sorted keys of db and checkpoint, only different keys are written
+			leveldb::ReadOptions read_options;
+			read_options.fill_cache = false;
+			leveldb::WriteOptions write_options;
+			std::unique_ptr<leveldb::Iterator> current_it(_db->NewIterator(read_options));
+			std::unique_ptr<leveldb::Iterator> checkpoint_it(checkpoint_db->NewIterator(read_options));
+			leveldb::WriteBatch batch;
+			current_it->SeekToFirst();
+			checkpoint_it->SeekToFirst();
+			while (current_it->Valid() || checkpoint_it->Valid())
+			{
+				int compared;
+				if (!current_it->Valid())
+					compared = 1;
+				else if (!checkpoint_it->Valid())
+					compared = -1;
+				else
+					compared = current_it->key().compare(checkpoint_it->key());
+				if (compared < 0)
+				{
+					batch.Delete(current_it->key());
+					changed_leveldb_keys.push_back(current_it->key().ToString());
+					current_it->Next();
+				}
+				else if (compared > 0)
+				{
+					// history of commits before the checkpoint missing now has been pruned since the checkpoint was taken
+					if (!is_commit_history_key(checkpoint_it->key().ToString()))
 					{
-						// events key delete
-						const auto& commit_events_key = make_commit_events_key(i->commit_id);
-						auto delete_commit_events_key_status = _db->Delete(write_options, commit_events_key);
-						if (!delete_commit_events_key_status.ok() && !delete_commit_events_key_status.IsNotFound()) {
-							BOOST_THROW_EXCEPTION(ContractStorageException("rollback commit events failed"));
-						}
-						if (delete_commit_events_key_status.ok())
-							changed_leveldb_keys.push_back(commit_events_key);
+						batch.Put(checkpoint_it->key(), checkpoint_it->value());
+						changed_leveldb_keys.push_back(checkpoint_it->key().ToString());
 					}
+					checkpoint_it->Next();
 				}
 				else
 				{
-					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("not supported change type ") + i->change_type));
+					if (current_it->value().compare(checkpoint_it->value()) != 0)
+					{
+						batch.Put(checkpoint_it->key(), checkpoint_it->value());
+						changed_leveldb_keys.push_back(checkpoint_it->key().ToString());
+					}
+					current_it->Next();
+					checkpoint_it->Next();
+				}
+				if (batch.ApproximateSize() >= checkpoint_write_batch_bytes)
+				{
+					if (!_db->Write(write_options, &batch).ok())
+						BOOST_THROW_EXCEPTION(ContractStorageException("restore checkpoint error"));
+					batch.Clear();
 				}
+			}
+			if (!current_it->status().ok() || !checkpoint_it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("read checkpoint error"));
+			if (!_db->Write(write_options, &batch).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("restore checkpoint error"));
+			// root state hashes are restored with the state
+			load_root_state_hashes();
+
+			exec_sql_with_seq(_sql_db, "delete from commit_info where id>?1", nearest_checkpoint.commit_seq);
+			exec_sql_with_seq(_sql_db, "delete from commit_contracts where commit_seq>?1", nearest_checkpoint.commit_seq);
+			_commit_index.remove_after(nearest_checkpoint.commit_seq);
+			_sql_transaction_removed_commits = true;
+			return true;
+		}
+
+		bool ContractStorageService::is_commit_history_key(const std::string& key) const
+		{
+			static const std::vector<std::string> history_key_prefixes = { make_commit_undo_key(""), make_commit_events_key(""), make_transaction_events_key(""),
+				ContractEventLog::entry_key_prefix, ContractEventLog::transaction_index_prefix, ContractEventLog::contract_index_prefix,
+				ContractEventLog::name_index_prefix, ContractEventBloom::commit_key_prefix };
+			static const std::vector<std::string> state_key_prefixes = { contract_info_key_prefix, contract_storage_key_prefix,
+				contract_name_id_mapping_key_prefix, ContractStateTree::node_key_prefix, ContractEventBloom::range_key_prefix };
+			for (const auto& prefix : history_key_prefixes)
+			{
+				if (boost::starts_with(key, prefix))
+					return true;
+			}
+			for (const auto& prefix : state_key_prefixes)
+			{
+				if (boost::starts_with(key, prefix))
+					return false;
+			}
+			// diffs are saved by the commit id only
+			if (uses_binary_commit_ids())
+				return key.size() == commit_id_bytes_size;
+			return key.size() == 2 * commit_id_bytes_size && key.find_first_not_of("0123456789abcdef") == std::string::npos;
+		}
+
+		static void exec_sql(sqlite3* sql_db, const std::string& sql, jsondiff::JsonArray* records)
+		{
+			char *err_msg;
+			auto status = records ? sqlite3_exec(sql_db, sql.c_str(), &query_records_sql_callback, records, &err_msg)
+				: sqlite3_exec(sql_db, sql.c_str(), &empty_sql_callback, nullptr, &err_msg);
+			if (status != SQLITE_OK)
+			{
+				std::string err_msg_str(err_msg ? err_msg : "sql error");
+				sqlite3_free(err_msg);
+				BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+			}
+		}
+
+		static void exec_sql_with_seq(sqlite3* sql_db, const char* sql, uint64_t commit_seq)
+		{
+			sqlite3_stmt* stmt = nullptr;
+			if (sqlite3_prepare_v2(sql_db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+			{
+				sqlite3_finalize(stmt);
+				BOOST_THROW_EXCEPTION(ContractStorageException(sqlite3_errmsg(sql_db)));
+			}
+			BOOST_SCOPE_EXIT_ALL(&) {
+				sqlite3_finalize(stmt);
+			};
+			sqlite3_bind_int64(stmt, 1, (sqlite3_int64)commit_seq);
+			if (sqlite3_step(stmt) != SQLITE_DONE)
+				BOOST_THROW_EXCEPTION(ContractStorageException(sqlite3_errmsg(sql_db)));
+		}
+
+		static jsondiff::JsonObject query_finalized_record(sqlite3* sql_db)
+		{
+			jsondiff::JsonArray records;
+			exec_sql(sql_db, "select commit_seq, commit_id from commit_finalized where id=1", &records);
+			if (records.empty())
+				return jsondiff::JsonObject();
+			return records[0].as<jsondiff::JsonObject>();
+		}
+
+		void ContractStorageService::init_finalized_table()
+		{
+			// one row, commits before commit_seq are finalized
+			exec_sql(_sql_db, "CREATE TABLE IF NOT EXISTS commit_finalized (id INTEGER PRIMARY KEY, commit_seq INTEGER not null, commit_id varchar(255) not null)");
+		}
+
+		uint64_t ContractStorageService::finalized_commit_seq() const
+		{
+			check_db();
+			const auto& record = query_finalized_record(_sql_db);
+			if (record.find("commit_seq") == record.end())
+				return 0;
+			return record["commit_seq"].as_uint64();
+		}
+
+		ContractCommitId ContractStorageService::finalized_commit_id() const
+		{
+			check_db();
+			const auto& record = query_finalized_record(_sql_db);
+			if (record.find("commit_id") == record.end())
+				return EMPTY_COMMIT_ID;
+			return record["commit_id"].as_string();
+		}
+
+		void ContractStorageService::check_not_finalized(uint64_t commit_seq, const ContractCommitId& commit_id) const
+		{
+			if (commit_seq < finalized_commit_seq())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("can't rollback to commit ") + commit_id + " before finalized commit " + finalized_commit_id()));
+		}
+
+		void ContractStorageService::finalize_before(const ContractCommitId& commit_id)
+		{
+			check_db();
+			auto commit_info = get_commit_info(commit_id);
+			if (!commit_info)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + commit_id));
+			auto root_commit_info = get_commit_info(current_root_state_hash());
+			if (!root_commit_info || commit_info->id > root_commit_info->id)
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("can't finalize commit ") + commit_id + " after current root state hash"));
+			finalize_commit(*commit_info);
+		}
+
+		void ContractStorageService::finalize_old_blocks_if_needed()
+		{
+			if (_options.keep_last_blocks == 0 || _current_block_height <= _options.keep_last_blocks)
+				return;
+			// state after the last commit of the oldest kept block's former block must stay rollbackable
+			jsondiff::JsonArray records;
+			exec_sql(_sql_db, std::string("select id, ") + commit_id_sql_column() + ", change_type, contract_id, block_height from commit_info where block_height<="
+				+ std::to_string(_current_block_height - _options.keep_last_blocks) + " order by id desc limit 1", &records);
+			if (records.empty())
+				return;
+			const auto& record = records[0].as<jsondiff::JsonObject>();
+			ContractCommitInfo commit_info;
+			commit_info.id = record["id"].as_uint64();
+			commit_info.commit_id = record["commit_id"].as_string();
+			commit_info.change_type = record["change_type"].as_string();
+			commit_info.contract_id = record["contract_id"].as_string();
+			commit_info.block_height = (uint32_t)record["block_height"].as_uint64();
+			if (commit_info.id > finalized_commit_seq())
+				finalize_commit(commit_info);
+		}
+
+		void ContractStorageService::finalize_commit(const ContractCommitInfo& commit_info)
+		{
+			if (commit_info.id <= finalized_commit_seq())
+				return;
+			exec_sql(_sql_db, std::string("insert or replace into commit_finalized (id, commit_seq, commit_id) values (1, ") + std::to_string(commit_info.id) + ",'" + commit_info.commit_id + "')");
+			// checkpoints before the finalized commit can't be restored any more
+			for (const auto& checkpoint : get_checkpoints())
+			{
+				if (checkpoint.commit_seq >= commit_info.id)
+					break;
+				exec_sql(_sql_db, std::string("delete from commit_checkpoint where id=") + std::to_string(checkpoint.id));
+				remove_checkpoint_db(checkpoint.path);
+			}
+			if (_options.background_pruning)
+			{
+				start_background_pruning();
+				_prune_cv.notify_all();
+			}
+		}
+
+		size_t ContractStorageService::prune_history(size_t max_commits)
+		{
+			check_db();
+			return prune_history_batch(_sql_db, max_commits, _options.prune_events, uses_binary_commit_ids());
+		}
+
+		ContractPruneStats ContractStorageService::prune_stats() const
+		{
+			std::lock_guard<std::mutex> lock(_prune_mutex);
+			return _prune_stats;
+		}
+
+		size_t ContractStorageService::prune_history_batch(sqlite3* sql_db, size_t max_commits, bool prune_events, bool binary_commit_ids)
+		{
+			const auto& finalized_record = query_finalized_record(sql_db);
+			if (max_commits == 0 || finalized_record.find("commit_seq") == finalized_record.end())
+				return 0;
+			auto finalized_seq = finalized_record["commit_seq"].as_uint64();
+			jsondiff::JsonArray records;
+			exec_sql(sql_db, std::string("select id, ") + commit_id_sql_column_of_format(binary_commit_ids) + " from commit_info where id<" + std::to_string(finalized_seq)
+				+ " order by id asc limit " + std::to_string(max_commits), &records);
+			if (records.empty())
+				return 0;
 
-				// delete the rollbacked commit_info
-				char *delete_commit_info_err_msg;
-				std::string delete_commit_info_sql = std::string("delete from commit_info where commit_id='") + i->commit_id + "'";
-				auto delete_commit_info_status = sqlite3_exec(_sql_db, delete_commit_info_sql.c_str(), &empty_sql_callback, nullptr, &delete_commit_info_err_msg);
-				if (delete_commit_info_status != SQLITE_OK)
+			// commits before finalized commit are never read by rollback, so deleting them doesn't race with commits
+			leveldb::ReadOptions read_options;
+			read_options.fill_cache = false;
+			leveldb::WriteBatch batch;
+			ContractPruneStats stats;
+			uint64_t last_seq = 0;
+			for (const auto& item : records)
+			{
+				const auto& record = item.as<jsondiff::JsonObject>();
+				const auto& commit_id = saved_commit_id_of_format(record["commit_id"].as_string(), binary_commit_ids);
+				last_seq = record["id"].as_uint64();
+				std::vector<std::string> keys;
+				keys.push_back(commit_id);
+				keys.push_back(make_commit_undo_key(commit_id));
+				if (prune_events)
 				{
-					std::string err_msg_str(delete_commit_info_err_msg);
-					sqlite3_free(delete_commit_info_err_msg);
-					BOOST_THROW_EXCEPTION(ContractStorageException(err_msg_str));
+					const auto& commit_events_key = make_commit_events_key(commit_id);
+					std::string events_str_value;
+					if (_db->Get(read_options, commit_events_key, &events_str_value).ok())
+					{
+						const auto& events_json = jsondiff::json_loads(events_str_value);
+						if (events_json.is_array())
+						{
+							std::map<std::string, std::vector<ContractEventInfo>> transaction_events;
+							for (const auto& event_info : ContractChanges::events_from_json(events_json.as<jsondiff::JsonArray>()))
+							{
+								if (!event_info.transaction_id.empty())
+									transaction_events[event_info.transaction_id].push_back(event_info);
+							}
+							for (const auto& p : transaction_events)
+							{
+								// a later commit of the transaction overwrote the key, it's pruned with that commit
+								const auto& tx_events_key = make_transaction_events_key(p.first);
+								std::string tx_events_value;
+								if (_db->Get(read_options, tx_events_key, &tx_events_value).ok()
+									&& tx_events_value == jsondiff::json_dumps(ContractChanges::events_to_json(p.second)))
+									keys.push_back(tx_events_key);
+							}
+						}
+						keys.push_back(commit_events_key);
+					}
+					for (const auto& key : ContractEventLog::commit_keys(_db, read_options, last_seq))
+						keys.push_back(key);
+					keys.push_back(ContractEventBloom::make_commit_key(last_seq));
+				}
+				for (const auto& key : keys)
+				{
+					std::string value;
+					if (!_db->Get(read_options, key, &value).ok())
+						continue;
+					batch.Delete(key);
+					stats.bytes_reclaimed += key.size() + value.size();
 				}
+				stats.bytes_reclaimed += sizeof(uint64_t) + commit_id.size();
+				stats.commits_pruned++;
+			}
+			// leveldb first, commit_info left by a failed prune is pruned again
+			leveldb::WriteOptions write_options;
+			if (!_db->Write(write_options, &batch).ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("prune commits history error"));
+			// last_seq is below finalized seq, so the finalized commit is kept
+			exec_sql_with_seq(sql_db, "delete from commit_info where id<=?1", last_seq);
+			exec_sql_with_seq(sql_db, "delete from commit_contracts where commit_seq<=?1", last_seq);
+			_commit_index.mark_pruned(last_seq);
+
+			std::lock_guard<std::mutex> lock(_prune_mutex);
+			_prune_stats.commits_pruned += stats.commits_pruned;
+			_prune_stats.bytes_reclaimed += stats.bytes_reclaimed;
+			return (size_t)stats.commits_pruned;
+		}
 
-				// delete the rollbackedCommitId => value in db
-				auto deleteCommitIdValueStatus = _db->Delete(write_options, i->commit_id);
-				if (!deleteCommitIdValueStatus.ok())
-					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("delete commit ") + i->commit_id + " error"));
+		void ContractStorageService::start_background_pruning()
+		{
+			if (_prune_thread.joinable())
+				return;
+			ContractSqliteOptions sqlite_options;
+			{
+				std::lock_guard<std::mutex> lock(_prune_mutex);
+				_prune_stop = false;
+				sqlite_options = _prune_options.sqlite;
 			}
+			// commits to prune exist, so the format is decided and never changes while the thread runs
+			bool binary_commit_ids = uses_binary_commit_ids();
+			_prune_thread = std::thread([this, sqlite_options, binary_commit_ids]() {
+				background_pruning_loop(sqlite_options, binary_commit_ids);
+			});
+		}
 
-			const auto& root_state_hash = dest_commit_id;
-			if (!_db->Put(write_options, root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update root state hash error"));
-			changed_leveldb_keys.push_back(root_state_hash_key);
-			if (!_db->Put(write_options, top_root_state_hash_key, root_state_hash).ok())
-				BOOST_THROW_EXCEPTION(ContractStorageException("update top root state hash error"));
-			changed_leveldb_keys.push_back(top_root_state_hash_key);
+		void ContractStorageService::stop_background_pruning()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_prune_mutex);
+				_prune_stop = true;
+			}
+			_prune_cv.notify_all();
+			if (_prune_thread.joinable())
+				_prune_thread.join();
+		}
+
+		void ContractStorageService::background_pruning_loop(const ContractSqliteOptions& sqlite_options, bool binary_commit_ids)
+		{
+			sqlite3* sql_db = nullptr;
+			if (sqlite3_open(_storage_sql_db_path.c_str(), &sql_db) != SQLITE_OK)
+			{
+				sqlite3_close(sql_db);
+				return;
+			}
+			BOOST_SCOPE_EXIT_ALL(&) {
+				sqlite3_close(sql_db);
+			};
+			try
+			{
+				apply_sqlite_options(sql_db, sqlite_options);
+			}
+			catch (...)
+			{
+				return;
+			}
+			std::unique_lock<std::mutex> lock(_prune_mutex);
+			while (!_prune_stop)
+			{
+				auto batch_commits = _prune_options.prune_batch_commits;
+				auto prune_events = _prune_options.prune_events;
+				lock.unlock();
+				size_t pruned_count = 0;
+				try
+				{
+					pruned_count = prune_history_batch(sql_db, batch_commits, prune_events, binary_commit_ids);
+				}
+				catch (...)
+				{
+					// retried in next round
+				}
+				lock.lock();
+				// finalized commits in an uncommitted transaction are seen in next round
+				if (pruned_count == 0 && !_prune_stop)
+					_prune_cv.wait_for(lock, prune_poll_interval);
+			}
+		}
+
+		ContractCommitSubscriptionP ContractStorageService::subscribe(size_t queue_size, ContractSubscriberOverflowPolicy policy)
+		{
+			auto subscription = std::make_shared<ContractCommitSubscription>(queue_size, policy);
+			std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+			_subscriptions.push_back(subscription);
+			return subscription;
+		}
+
+		void ContractStorageService::unsubscribe(const ContractCommitSubscriptionP& subscription)
+		{
+			// a commit blocked on the subscription stops waiting
+			subscription->close();
+			std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+			_subscriptions.erase(std::remove(_subscriptions.begin(), _subscriptions.end(), subscription), _subscriptions.end());
+		}
+
+		bool ContractStorageService::has_subscribers() const
+		{
+			std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+			return !_subscriptions.empty();
+		}
+
+		void ContractStorageService::publish_notifications()
+		{
+			if (_pending_notifications.empty())
+				return;
+			std::vector<ContractCommitSubscriptionP> subscriptions;
+			{
+				std::lock_guard<std::mutex> lock(_subscriptions_mutex);
+				_subscriptions.erase(std::remove_if(_subscriptions.begin(), _subscriptions.end(), [](const ContractCommitSubscriptionP& subscription) {
+					return subscription->closed();
+				}), _subscriptions.end());
+				subscriptions = _subscriptions;
+			}
+			// pushing may wait for blocking subscribers, so it's out of the lock
+			for (const auto& notification : _pending_notifications)
+			{
+				for (const auto& subscription : subscriptions)
+					subscription->push(notification);
+			}
+			_pending_notifications.clear();
 		}
 
 		void ContractStorageService::rollback_contract_state(const ContractCommitId& dest_commit_id)
@@ -1031,6 +2949,8 @@ namespace contract
 			bool success = false;
 			leveldb::WriteOptions write_options;
 			leveldb::ReadOptions read_options;
+			// the checkpoint being created may be removed or restored
+			wait_background_checkpoint();
 			auto snapshot = _db->GetSnapshot();
 			std::vector<std::string> changed_leveldb_keys;
 			begin_sql_transaction();
@@ -1038,19 +2958,45 @@ namespace contract
 				if (success)
 				{
 					commit_sql_transaction();
+					publish_notifications();
 				}
 				else
 				{
+					_pending_notifications.clear();
 					rollback_sql_transaction();
 					rollback_leveldb_transaction(snapshot, changed_leveldb_keys);
 				}
 			};
 			auto commit_info = get_commit_info(dest_commit_id);
 			if (!commit_info && dest_commit_id != EMPTY_COMMIT_ID)
+			{
+				if (finalized_commit_seq() > 0)
+					BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id + ", commits before finalized commit " + finalized_commit_id() + " are pruned"));
 				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("Can't find commit ") + dest_commit_id));
+			}
 			rollback_to_root_state_hash_without_transactional(dest_commit_id, changed_leveldb_keys);
 			success = true;
 		}
 
+		ContractCommitId ContractStorageService::rollback_to_block_height(uint32_t block_height)
+		{
+			check_db();
+			// block heights of commits may go down after set_current_block_height, so no commit above block_height is kept
+			jsondiff::JsonArray records;
+			exec_sql(_sql_db, std::string("select min(id) as first_seq from commit_info where block_height>") + std::to_string(block_height), &records);
+			if (records.empty() || records[0]["first_seq"].is_null())
+				return current_root_state_hash();
+			auto first_seq = records[0]["first_seq"].as_uint64();
+			const auto& dest_commit_infos = query_commit_infos(std::string("where id<") + std::to_string(first_seq) + " order by id desc limit 1");
+			const auto& dest_commit_id = dest_commit_infos.empty() ? ContractCommitId(EMPTY_COMMIT_ID) : dest_commit_infos[0].commit_id;
+			rollback_contract_state(dest_commit_id);
+			return dest_commit_id;
+		}
+
+		std::vector<ContractCommitInfo> ContractStorageService::commits_in_block(uint32_t block_height) const
+		{
+			return query_commit_infos(std::string("where block_height=") + std::to_string(block_height) + " order by id");
+		}
+
 	}
 }
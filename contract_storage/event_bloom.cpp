@@ -0,0 +1,166 @@
+#include <contract_storage/event_bloom.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <fcrypto/sha256.hpp>
+#include <boost/exception/all.hpp>
+#include <algorithm>
+
+namespace contract
+{
+	namespace storage
+	{
+		const std::string ContractEventBloom::commit_key_prefix = "event_bloom$";
+		const std::string ContractEventBloom::range_key_prefix = "event_range_bloom$";
+		const std::string ContractEventBloom::open_range_key = "EVENT_BLOOM_OPEN_RANGE";
+
+		// about 1% false positives with 10 bits and 7 hashes per item
+		static const size_t bloom_bits_per_item = 10;
+		static const size_t bloom_hashes_count = 7;
+		static const size_t bloom_items_per_event = 3;
+		static const size_t bloom_min_bytes = 8;
+
+		static std::string to_hex(uint64_t value, size_t hex_size)
+		{
+			static const char* hex_chars = "0123456789abcdef";
+			std::string hex;
+			for (size_t i = hex_size; i > 0; i--)
+				hex.push_back(hex_chars[(value >> (4 * (i - 1))) & 0xf]);
+			return hex;
+		}
+
+		static void append_uint64(std::string& out, uint64_t value)
+		{
+			for (size_t i = 0; i < 8; i++)
+				out.push_back((char)(value >> (56 - 8 * i)));
+		}
+
+		static uint64_t read_uint64(const std::string& data, size_t pos)
+		{
+			uint64_t value = 0;
+			for (size_t i = 0; i < 8; i++)
+				value = (value << 8) | (unsigned char)data[pos + i];
+			return value;
+		}
+
+		// little endian words of the digest, the same bits on every platform
+		static std::vector<uint64_t> item_bits(const std::string& item, uint64_t bits_count)
+		{
+			const auto& digest = fcrypto::sha256::hash(item.data(), (uint32_t)item.size());
+			auto bytes = (const unsigned char*)digest.data();
+			std::vector<uint64_t> bits;
+			for (size_t i = 0; i < bloom_hashes_count; i++)
+			{
+				uint32_t word = (uint32_t)bytes[4 * i] | ((uint32_t)bytes[4 * i + 1] << 8) | ((uint32_t)bytes[4 * i + 2] << 16) | ((uint32_t)bytes[4 * i + 3] << 24);
+				bits.push_back(word % bits_count);
+			}
+			return bits;
+		}
+
+		ContractEventBloom::ContractEventBloom()
+			: _bits(bloom_min_bytes, '\0')
+		{
+		}
+
+		ContractEventBloom::ContractEventBloom(size_t events_count)
+		{
+			auto bytes_count = (events_count * bloom_items_per_event * bloom_bits_per_item + 7) / 8;
+			// whole 64 bit words
+			bytes_count = std::max(bloom_min_bytes, (bytes_count + 7) / 8 * 8);
+			_bits.assign(bytes_count, '\0');
+		}
+
+		ContractEventBloom ContractEventBloom::from_bytes(const std::string& bytes)
+		{
+			if (bytes.empty() || bytes.size() % bloom_min_bytes)
+				BOOST_THROW_EXCEPTION(ContractStorageException("event bloom size error"));
+			ContractEventBloom bloom;
+			bloom._bits = bytes;
+			return bloom;
+		}
+
+		void ContractEventBloom::add_item(const std::string& item)
+		{
+			uint64_t bits_count = _bits.size() * 8;
+			for (auto bit : item_bits(item, bits_count))
+				_bits[bit / 8] |= (char)(1 << (bit % 8));
+		}
+
+		bool ContractEventBloom::may_contain_item(const std::string& item) const
+		{
+			uint64_t bits_count = _bits.size() * 8;
+			for (auto bit : item_bits(item, bits_count))
+			{
+				if (!(_bits[bit / 8] & (1 << (bit % 8))))
+					return false;
+			}
+			return true;
+		}
+
+		// tag of the item kind keeps a contract id and an event name with the same text apart
+		static std::string contract_item(const AddressType& contract_id)
+		{
+			return std::string("c") + contract_id;
+		}
+
+		static std::string event_name_item(const std::string& event_name)
+		{
+			return std::string("n") + event_name;
+		}
+
+		static std::string pair_item(const AddressType& contract_id, const std::string& event_name)
+		{
+			return std::string("p") + contract_id + std::string(1, '\0') + event_name;
+		}
+
+		void ContractEventBloom::add_event(const ContractEventInfo& event)
+		{
+			add_item(contract_item(event.contract_id));
+			add_item(event_name_item(event.event_name));
+			add_item(pair_item(event.contract_id, event.event_name));
+		}
+
+		bool ContractEventBloom::may_contain_contract(const AddressType& contract_id) const
+		{
+			return may_contain_item(contract_item(contract_id));
+		}
+
+		bool ContractEventBloom::may_contain_event_name(const std::string& event_name) const
+		{
+			return may_contain_item(event_name_item(event_name));
+		}
+
+		bool ContractEventBloom::may_contain(const AddressType& contract_id, const std::string& event_name) const
+		{
+			return may_contain_item(pair_item(contract_id, event_name));
+		}
+
+		std::string ContractEventBloom::make_commit_key(uint64_t commit_seq)
+		{
+			return commit_key_prefix + to_hex(commit_seq, 16);
+		}
+
+		std::string ContractEventBloom::make_range_key(uint32_t range_index)
+		{
+			return range_key_prefix + to_hex(range_index, 8);
+		}
+
+		std::string ContractEventRangeBloom::encode() const
+		{
+			std::string out;
+			append_uint64(out, first_commit_seq);
+			append_uint64(out, last_commit_seq);
+			out.append(bloom.bytes());
+			return out;
+		}
+
+		ContractEventRangeBloom ContractEventRangeBloom::decode(const std::string& data)
+		{
+			if (data.size() < 16)
+				BOOST_THROW_EXCEPTION(ContractStorageException("event range bloom format error"));
+			ContractEventRangeBloom range;
+			range.first_commit_seq = read_uint64(data, 0);
+			range.last_commit_seq = read_uint64(data, 8);
+			range.bloom = ContractEventBloom::from_bytes(data.substr(16));
+			return range;
+		}
+	}
+}
@@ -0,0 +1,399 @@
+#include <contract_storage/event_log.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <boost/exception/all.hpp>
+#include <cstdint>
+#include <algorithm>
+
+namespace contract
+{
+	namespace storage
+	{
+		const std::string ContractEventLog::entry_key_prefix = "event_log$";
+		const std::string ContractEventLog::transaction_index_prefix = "event_tx$";
+		const std::string ContractEventLog::contract_index_prefix = "event_contract$";
+		const std::string ContractEventLog::name_index_prefix = "event_name$";
+
+		static const char event_entry_version = 1;
+		static const size_t commit_seq_hex_size = 16;
+		static const size_t event_index_hex_size = 8;
+		static const size_t position_size = commit_seq_hex_size + event_index_hex_size;
+
+		static void append_hex(std::string& out, uint64_t value, size_t hex_size)
+		{
+			static const char* hex_chars = "0123456789abcdef";
+			for (size_t i = hex_size; i > 0; i--)
+				out.push_back(hex_chars[(value >> (4 * (i - 1))) & 0xf]);
+		}
+
+		static bool parse_hex(const std::string& data, size_t pos, size_t hex_size, uint64_t* value)
+		{
+			*value = 0;
+			for (size_t i = pos; i < pos + hex_size; i++)
+			{
+				auto c = data[i];
+				if (c >= '0' && c <= '9')
+					*value = *value * 16 + (c - '0');
+				else if (c >= 'a' && c <= 'f')
+					*value = *value * 16 + (c - 'a' + 10);
+				else
+					return false;
+			}
+			return true;
+		}
+
+		static void write_string(std::string& out, const std::string& value)
+		{
+			uint64_t size = value.size();
+			while (size >= 0x80)
+			{
+				out.push_back((char)((size & 0x7f) | 0x80));
+				size >>= 7;
+			}
+			out.push_back((char)size);
+			out.append(value);
+		}
+
+		static std::string read_string(const std::string& data, size_t& pos)
+		{
+			uint64_t size = 0;
+			for (int shift = 0;; shift += 7)
+			{
+				if (pos >= data.size() || shift >= 64)
+					BOOST_THROW_EXCEPTION(ContractStorageException("event log entry format error"));
+				auto byte = (unsigned char)data[pos++];
+				size |= (uint64_t)(byte & 0x7f) << shift;
+				if (!(byte & 0x80))
+					break;
+			}
+			if (size > data.size() - pos)
+				BOOST_THROW_EXCEPTION(ContractStorageException("event log entry format error"));
+			std::string value(data, pos, size);
+			pos += size;
+			return value;
+		}
+
+		// index keys of an event, the log entry key excluded
+		static std::vector<std::string> event_index_keys(const ContractEventInfo& event, const std::string& position)
+		{
+			std::vector<std::string> keys;
+			if (!event.transaction_id.empty())
+				keys.push_back(ContractEventLog::make_index_prefix(ContractEventLog::transaction_index_prefix, event.transaction_id) + position);
+			keys.push_back(ContractEventLog::make_index_prefix(ContractEventLog::contract_index_prefix, event.contract_id) + position);
+			keys.push_back(ContractEventLog::make_index_prefix(ContractEventLog::name_index_prefix, event.event_name) + position);
+			return keys;
+		}
+
+		std::string ContractEventLog::make_position(uint64_t commit_seq, uint32_t event_index)
+		{
+			std::string position;
+			append_hex(position, commit_seq, commit_seq_hex_size);
+			append_hex(position, event_index, event_index_hex_size);
+			return position;
+		}
+
+		bool ContractEventLog::parse_position(const std::string& position, uint64_t* commit_seq, uint32_t* event_index)
+		{
+			uint64_t index;
+			if (position.size() != position_size || !parse_hex(position, 0, commit_seq_hex_size, commit_seq)
+				|| !parse_hex(position, commit_seq_hex_size, event_index_hex_size, &index))
+				return false;
+			*event_index = (uint32_t)index;
+			return true;
+		}
+
+		std::string ContractEventLog::make_entry_key(uint64_t commit_seq, uint32_t event_index)
+		{
+			return entry_key_prefix + make_position(commit_seq, event_index);
+		}
+
+		std::string ContractEventLog::make_index_prefix(const std::string& index_prefix, const std::string& value)
+		{
+			// values may contain '$', the fixed width position after the last '$' keeps keys unambiguous
+			return index_prefix + value + "$";
+		}
+
+		std::string ContractEventLog::encode_event(const ContractEventInfo& event)
+		{
+			std::string out;
+			out.push_back(event_entry_version);
+			write_string(out, event.transaction_id);
+			write_string(out, event.contract_id);
+			write_string(out, event.event_name);
+			write_string(out, event.event_arg);
+			return out;
+		}
+
+		ContractEventInfo ContractEventLog::decode_event(const std::string& data)
+		{
+			if (data.empty() || data[0] != event_entry_version)
+				BOOST_THROW_EXCEPTION(ContractStorageException("event log entry format error"));
+			size_t pos = 1;
+			ContractEventInfo event;
+			event.transaction_id = read_string(data, pos);
+			event.contract_id = read_string(data, pos);
+			event.event_name = read_string(data, pos);
+			event.event_arg = read_string(data, pos);
+			return event;
+		}
+
+		void ContractEventLog::append(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events)
+		{
+			for (size_t i = 0; i < events.size(); i++)
+			{
+				const auto& position = make_position(commit_seq, (uint32_t)i);
+				writes.put(entry_key_prefix + position, encode_event(events[i]));
+				// the position in the index key finds the entry, so index values are empty
+				for (const auto& key : event_index_keys(events[i], position))
+					writes.put(key, "");
+			}
+		}
+
+		void ContractEventLog::remove(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events)
+		{
+			for (size_t i = 0; i < events.size(); i++)
+			{
+				const auto& position = make_position(commit_seq, (uint32_t)i);
+				writes.remove(entry_key_prefix + position);
+				for (const auto& key : event_index_keys(events[i], position))
+					writes.remove(key);
+			}
+		}
+
+		std::vector<std::string> ContractEventLog::commit_keys(leveldb::DB* db, const leveldb::ReadOptions& read_options, uint64_t commit_seq)
+		{
+			std::vector<std::string> keys;
+			std::string commit_prefix = entry_key_prefix;
+			append_hex(commit_prefix, commit_seq, commit_seq_hex_size);
+			std::unique_ptr<leveldb::Iterator> it(db->NewIterator(read_options));
+			for (it->Seek(commit_prefix); it->Valid() && it->key().starts_with(commit_prefix); it->Next())
+			{
+				const auto& key = it->key().ToString();
+				for (const auto& index_key : event_index_keys(decode_event(it->value().ToString()), key.substr(entry_key_prefix.size())))
+					keys.push_back(index_key);
+				keys.push_back(key);
+			}
+			if (!it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("read event log error"));
+			return keys;
+		}
+
+		ContractEventLogIterator::ContractEventLogIterator(leveldb::DB* db, const leveldb::Snapshot* snapshot, const std::string& index_prefix, const std::string& value,
+			const std::string& from_position, uint64_t to_commit_seq)
+			: _db(db), _snapshot(snapshot), _owns_snapshot(!snapshot), _is_index(!index_prefix.empty())
+		{
+			if (_owns_snapshot)
+				_snapshot = _db->GetSnapshot();
+			_read_options.snapshot = _snapshot;
+			_it.reset(_db->NewIterator(_read_options));
+			_prefix = _is_index ? ContractEventLog::make_index_prefix(index_prefix, value) : ContractEventLog::entry_key_prefix;
+			if (to_commit_seq < UINT64_MAX)
+				_end_position = ContractEventLog::make_position(to_commit_seq + 1, 0);
+			_it->Seek(_prefix + from_position);
+			load();
+		}
+
+		ContractEventLogIterator::~ContractEventLogIterator()
+		{
+			_it.reset();
+			if (_owns_snapshot)
+				_db->ReleaseSnapshot(_snapshot);
+		}
+
+		void ContractEventLogIterator::next()
+		{
+			if (!_valid)
+				return;
+			_it->Next();
+			load();
+		}
+
+		void ContractEventLogIterator::seek(const std::string& from_position)
+		{
+			_it->Seek(_prefix + from_position);
+			load();
+		}
+
+		void ContractEventLogIterator::load()
+		{
+			_valid = false;
+			for (; _it->Valid() && _it->key().starts_with(_prefix); _it->Next())
+			{
+				const auto& key = _it->key();
+				// index keys of longer values sharing the prefix
+				if (key.size() != _prefix.size() + position_size)
+					continue;
+				std::string position(key.data() + _prefix.size(), position_size);
+				if (!_end_position.empty() && position >= _end_position)
+					break;
+				uint64_t commit_seq;
+				uint64_t event_index;
+				if (!parse_hex(position, 0, commit_seq_hex_size, &commit_seq) || !parse_hex(position, commit_seq_hex_size, event_index_hex_size, &event_index))
+					continue;
+				std::string entry_value;
+				if (!_is_index)
+					entry_value = _it->value().ToString();
+				else if (!_db->Get(_read_options, ContractEventLog::entry_key_prefix + position, &entry_value).ok())
+					continue;
+				_entry.commit_seq = commit_seq;
+				_entry.event_index = (uint32_t)event_index;
+				_entry.event = ContractEventLog::decode_event(entry_value);
+				_valid = true;
+				return;
+			}
+			if (!_it->status().ok())
+				BOOST_THROW_EXCEPTION(ContractStorageException("read event log error"));
+		}
+	
+		ContractEventCursor::ContractEventCursor(leveldb::DB* db, const ContractEventFilter& filter, uint64_t from_commit_seq, uint64_t to_commit_seq,
+			std::function<bool(uint64_t)> commit_seq_matches)
+			: _db(db), _event_names(filter.event_names), _commit_seq_matches(commit_seq_matches), _limit(filter.limit)
+		{
+			auto from_position = ContractEventLog::make_position(from_commit_seq, 0);
+			if (!filter.continuation.empty())
+			{
+				uint64_t commit_seq;
+				uint32_t event_index;
+				if (!ContractEventLog::parse_position(filter.continuation, &commit_seq, &event_index))
+					BOOST_THROW_EXCEPTION(ContractStorageException("invalid event query continuation token"));
+				from_position = std::max(from_position, filter.continuation);
+			}
+			_snapshot = _db->GetSnapshot();
+			_read_options.snapshot = _snapshot;
+			if (from_commit_seq <= to_commit_seq)
+			{
+				// an event has one contract id and one name, so iterators of one index never return the same event
+				if (!filter.contract_ids.empty())
+				{
+					for (const auto& contract_id : filter.contract_ids)
+					{
+						_iterators.push_back(ContractEventLogIteratorP(new ContractEventLogIterator(_db, _snapshot, ContractEventLog::contract_index_prefix, contract_id, from_position, to_commit_seq)));
+						_iterator_contract_ids.push_back(contract_id);
+						_checked_commit_seqs.push_back(0);
+					}
+					if (!_event_names.empty())
+					{
+						std::unique_ptr<leveldb::Iterator> it(_db->NewIterator(_read_options));
+						for (it->Seek(ContractEventBloom::range_key_prefix); it->Valid() && it->key().starts_with(ContractEventBloom::range_key_prefix); it->Next())
+						{
+							const auto& range = ContractEventRangeBloom::decode(it->value().ToString());
+							if (range.last_commit_seq >= from_commit_seq && range.first_commit_seq <= to_commit_seq)
+								_range_blooms.push_back(range);
+						}
+						if (!it->status().ok())
+							BOOST_THROW_EXCEPTION(ContractStorageException("read event blooms error"));
+						std::sort(_range_blooms.begin(), _range_blooms.end(), [](const ContractEventRangeBloom& a, const ContractEventRangeBloom& b) {
+							return a.first_commit_seq < b.first_commit_seq;
+						});
+					}
+				}
+				else if (!filter.event_names.empty())
+				{
+					for (const auto& event_name : filter.event_names)
+						_iterators.push_back(ContractEventLogIteratorP(new ContractEventLogIterator(_db, _snapshot, ContractEventLog::name_index_prefix, event_name, from_position, to_commit_seq)));
+					_event_names.clear();
+				}
+				else
+				{
+					_iterators.push_back(ContractEventLogIteratorP(new ContractEventLogIterator(_db, _snapshot, "", "", from_position, to_commit_seq)));
+				}
+			}
+			find_match();
+		}
+
+		ContractEventCursor::~ContractEventCursor()
+		{
+			_iterators.clear();
+			_db->ReleaseSnapshot(_snapshot);
+		}
+
+		void ContractEventCursor::next()
+		{
+			if (!_current)
+				return;
+			_current->next();
+			find_match();
+		}
+
+		bool ContractEventCursor::bloom_matches(const ContractEventBloom& bloom, const AddressType& contract_id) const
+		{
+			for (const auto& event_name : _event_names)
+			{
+				if (bloom.may_contain(contract_id, event_name))
+					return true;
+			}
+			return false;
+		}
+
+		void ContractEventCursor::skip_unmatched(size_t index)
+		{
+			auto& it = *_iterators[index];
+			const auto& contract_id = _iterator_contract_ids[index];
+			while (it.valid())
+			{
+				auto commit_seq = it.entry().commit_seq;
+				// last range starting at or before the commit
+				auto range_it = std::upper_bound(_range_blooms.begin(), _range_blooms.end(), commit_seq, [](uint64_t seq, const ContractEventRangeBloom& range) {
+					return seq < range.first_commit_seq;
+				});
+				if (range_it != _range_blooms.begin())
+				{
+					const auto& range = *(range_it - 1);
+					if (commit_seq <= range.last_commit_seq && !bloom_matches(range.bloom, contract_id))
+					{
+						it.seek(ContractEventLog::make_position(range.last_commit_seq + 1, 0));
+						continue;
+					}
+				}
+				if (_checked_commit_seqs[index] == commit_seq)
+					return;
+				_checked_commit_seqs[index] = commit_seq;
+				std::string bloom_bytes;
+				if (_db->Get(_read_options, ContractEventBloom::make_commit_key(commit_seq), &bloom_bytes).ok()
+					&& !bloom_matches(ContractEventBloom::from_bytes(bloom_bytes), contract_id))
+				{
+					it.seek(ContractEventLog::make_position(commit_seq + 1, 0));
+					continue;
+				}
+				return;
+			}
+		}
+
+		void ContractEventCursor::find_match()
+		{
+			for (;;)
+			{
+				_current = nullptr;
+				for (size_t i = 0; i < _iterators.size(); i++)
+				{
+					const auto& it = _iterators[i];
+					if (!_iterator_contract_ids.empty() && !_event_names.empty())
+						skip_unmatched(i);
+					if (!it->valid())
+						continue;
+					const auto& entry = it->entry();
+					if (!_current || entry.commit_seq < _current->entry().commit_seq
+						|| (entry.commit_seq == _current->entry().commit_seq && entry.event_index < _current->entry().event_index))
+						_current = it.get();
+				}
+				if (!_current)
+					return;
+				auto commit_seq = _current->entry().commit_seq;
+				if (_commit_seq_matches && !_commit_seq_matches(commit_seq))
+				{
+					_current->seek(ContractEventLog::make_position(commit_seq + 1, 0));
+					continue;
+				}
+				if (_event_names.empty() || _event_names.find(_current->entry().event.event_name) != _event_names.end())
+					break;
+				_current->next();
+			}
+			if (_limit > 0 && _count >= _limit)
+			{
+				_continuation = ContractEventLog::make_position(_current->entry().commit_seq, _current->entry().event_index);
+				_current = nullptr;
+				return;
+			}
+			_count++;
+		}
+	}
+}
@@ -0,0 +1,132 @@
+#include <contract_storage/state_set_hash.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <fcrypto/sha256.hpp>
+#include <boost/exception/all.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		static const size_t set_hash_size = 32;
+
+		static void limbs_from_bytes(const char* data, uint64_t* limbs)
+		{
+			for (size_t i = 0; i < 4; i++)
+			{
+				uint64_t limb = 0;
+				for (size_t j = 0; j < 8; j++)
+					limb = (limb << 8) | (unsigned char)data[(3 - i) * 8 + j];
+				limbs[i] = limb;
+			}
+		}
+
+		static void element_limbs(const std::string& key, const std::string& value, uint64_t* limbs)
+		{
+			fcrypto::sha256::encoder enc;
+			uint64_t key_size = key.size();
+			char size_bytes[8];
+			for (size_t i = 0; i < 8; i++)
+				size_bytes[i] = (char)(key_size >> (56 - 8 * i));
+			// key size makes the split of key and value unique
+			enc.write(size_bytes, sizeof(size_bytes));
+			enc.write(key.data(), (uint32_t)key.size());
+			enc.write(value.data(), (uint32_t)value.size());
+			limbs_from_bytes(enc.result().data(), limbs);
+		}
+
+		ContractStateSetHash::ContractStateSetHash()
+		{
+			for (auto& limb : _limbs)
+				limb = 0;
+		}
+
+		ContractStateSetHash ContractStateSetHash::from_bytes(const std::string& bytes)
+		{
+			if (bytes.size() != set_hash_size)
+				BOOST_THROW_EXCEPTION(ContractStorageException("state set hash size error"));
+			ContractStateSetHash result;
+			limbs_from_bytes(bytes.data(), result._limbs);
+			return result;
+		}
+
+		void ContractStateSetHash::add_limbs(const uint64_t* limbs)
+		{
+			uint64_t carry = 0;
+			for (size_t i = 0; i < 4; i++)
+			{
+				auto sum = _limbs[i] + limbs[i];
+				auto next_carry = sum < limbs[i] ? 1 : 0;
+				_limbs[i] = sum + carry;
+				if (_limbs[i] < carry)
+					next_carry = 1;
+				carry = next_carry;
+			}
+		}
+
+		void ContractStateSetHash::sub_limbs(const uint64_t* limbs)
+		{
+			uint64_t borrow = 0;
+			for (size_t i = 0; i < 4; i++)
+			{
+				auto diff = _limbs[i] - limbs[i];
+				auto next_borrow = _limbs[i] < limbs[i] ? 1 : 0;
+				if (diff < borrow)
+					next_borrow = 1;
+				_limbs[i] = diff - borrow;
+				borrow = next_borrow;
+			}
+		}
+
+		void ContractStateSetHash::add(const std::string& key, const std::string& value)
+		{
+			uint64_t limbs[4];
+			element_limbs(key, value, limbs);
+			add_limbs(limbs);
+		}
+
+		void ContractStateSetHash::remove(const std::string& key, const std::string& value)
+		{
+			uint64_t limbs[4];
+			element_limbs(key, value, limbs);
+			sub_limbs(limbs);
+		}
+
+		void ContractStateSetHash::merge(const ContractStateSetHash& other)
+		{
+			add_limbs(other._limbs);
+		}
+
+		std::string ContractStateSetHash::bytes() const
+		{
+			std::string result(set_hash_size, '\0');
+			for (size_t i = 0; i < 4; i++)
+			{
+				for (size_t j = 0; j < 8; j++)
+					result[(3 - i) * 8 + j] = (char)(_limbs[i] >> (56 - 8 * j));
+			}
+			return result;
+		}
+
+		std::string ContractStateSetHash::str() const
+		{
+			static const char* hex_chars = "0123456789abcdef";
+			std::string result;
+			for (auto c : bytes())
+			{
+				result.push_back(hex_chars[((unsigned char)c) >> 4]);
+				result.push_back(hex_chars[((unsigned char)c) & 0xf]);
+			}
+			return result;
+		}
+
+		bool ContractStateSetHash::operator==(const ContractStateSetHash& other) const
+		{
+			for (size_t i = 0; i < 4; i++)
+			{
+				if (_limbs[i] != other._limbs[i])
+					return false;
+			}
+			return true;
+		}
+	}
+}
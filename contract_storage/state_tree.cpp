@@ -0,0 +1,325 @@
+#include <contract_storage/state_tree.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <boost/exception/all.hpp>
+#include <cstring>
+
+namespace contract
+{
+	namespace storage
+	{
+		const std::string ContractStateTree::node_key_prefix = "smt$";
+
+		static const size_t hash_size = 32;
+
+		ContractStateTree::ContractStateTree(ContractWriteSet& writes)
+			: _writes(writes)
+		{
+		}
+
+		fcrypto::sha256 ContractStateTree::key_path(const std::string& key)
+		{
+			return fcrypto::sha256::hash(key.c_str(), (uint32_t)key.size());
+		}
+
+		fcrypto::sha256 ContractStateTree::leaf_hash(const fcrypto::sha256& path, const fcrypto::sha256& value_hash)
+		{
+			fcrypto::sha256::encoder enc;
+			enc.put(0);
+			enc.write(path.data(), hash_size);
+			enc.write(value_hash.data(), hash_size);
+			return enc.result();
+		}
+
+		fcrypto::sha256 ContractStateTree::inner_hash(const fcrypto::sha256& left, const fcrypto::sha256& right)
+		{
+			fcrypto::sha256::encoder enc;
+			enc.put(1);
+			enc.write(left.data(), hash_size);
+			enc.write(right.data(), hash_size);
+			return enc.result();
+		}
+
+		bool ContractStateTree::path_bit(const fcrypto::sha256& path, size_t index)
+		{
+			return (((unsigned char)path.data()[index / 8]) >> (7 - index % 8)) & 1;
+		}
+
+		fcrypto::sha256 ContractStateTree::Node::hash() const
+		{
+			switch (type)
+			{
+			case LEAF_NODE:
+				return leaf_hash(first, second);
+			case INNER_NODE:
+				return inner_hash(first, second);
+			default:
+				return fcrypto::sha256();
+			}
+		}
+
+		// node key is prefix + 2 bytes depth + first depth bits of path
+		std::string ContractStateTree::make_node_key(size_t depth, const fcrypto::sha256& path)
+		{
+			std::string key(node_key_prefix);
+			key.push_back((char)(depth >> 8));
+			key.push_back((char)(depth & 0xff));
+			auto bytes_count = (depth + 7) / 8;
+			key.append(path.data(), bytes_count);
+			if (depth % 8)
+				key[key.size() - 1] &= (char)(0xff << (8 - depth % 8));
+			return key;
+		}
+
+		ContractStateTree::Node ContractStateTree::read_node(size_t depth, const fcrypto::sha256& path) const
+		{
+			Node node;
+			std::string value;
+			if (!_writes.get(make_node_key(depth, path), &value))
+				return node;
+			if (value.size() != 1 + 2 * hash_size || (value[0] != LEAF_NODE && value[0] != INNER_NODE))
+				BOOST_THROW_EXCEPTION(ContractStorageException("state tree node format error"));
+			node.type = (NodeType)value[0];
+			memcpy(node.first.data(), value.data() + 1, hash_size);
+			memcpy(node.second.data(), value.data() + 1 + hash_size, hash_size);
+			return node;
+		}
+
+		void ContractStateTree::write_node(size_t depth, const fcrypto::sha256& path, const Node& node)
+		{
+			const auto& key = make_node_key(depth, path);
+			if (node.type == EMPTY_NODE)
+			{
+				_writes.remove(key);
+				return;
+			}
+			std::string value;
+			value.push_back((char)node.type);
+			value.append(node.first.data(), hash_size);
+			value.append(node.second.data(), hash_size);
+			_writes.put(key, value);
+		}
+
+		void ContractStateTree::put(const std::string& key, const std::string& value)
+		{
+			update(0, key_path(key), fcrypto::sha256::hash(value.c_str(), (uint32_t)value.size()), false);
+		}
+
+		void ContractStateTree::remove(const std::string& key)
+		{
+			update(0, key_path(key), fcrypto::sha256(), true);
+		}
+
+		fcrypto::sha256 ContractStateTree::root() const
+		{
+			return read_node(0, fcrypto::sha256()).hash();
+		}
+
+		ContractStateProof ContractStateTree::prove(const std::string& key) const
+		{
+			ContractStateProof proof;
+			proof.key = key;
+			proof.state_root = root().str();
+			const auto& path = key_path(key);
+			size_t depth = 0;
+			auto node = read_node(depth, path);
+			while (node.type == INNER_NODE)
+			{
+				auto is_right = path_bit(path, depth);
+				proof.siblings.push_back(is_right ? node.first : node.second);
+				depth++;
+				node = read_node(depth, path);
+			}
+			if (node.type == LEAF_NODE)
+			{
+				if (node.first == path)
+				{
+					if (!_writes.get(key, &proof.value))
+						BOOST_THROW_EXCEPTION(ContractStorageException(std::string("state tree leaf of missing key ") + key));
+					proof.exists = true;
+				}
+				else
+				{
+					proof.has_other_leaf = true;
+					proof.other_leaf_path = node.first;
+					proof.other_leaf_value_hash = node.second;
+				}
+			}
+			return proof;
+		}
+
+		bool ContractStateTree::verify(const ContractStateProof& proof, const fcrypto::sha256& root)
+		{
+			const auto& path = key_path(proof.key);
+			auto depth = proof.siblings.size();
+			if (depth >= path_bits)
+				return false;
+			fcrypto::sha256 hash;
+			if (proof.exists)
+			{
+				hash = leaf_hash(path, fcrypto::sha256::hash(proof.value.c_str(), (uint32_t)proof.value.size()));
+			}
+			else if (proof.has_other_leaf)
+			{
+				// the other leaf must be in the subtree where path of key ends
+				if (proof.other_leaf_path == path)
+					return false;
+				for (size_t i = 0; i < depth; i++)
+				{
+					if (path_bit(proof.other_leaf_path, i) != path_bit(path, i))
+						return false;
+				}
+				hash = leaf_hash(proof.other_leaf_path, proof.other_leaf_value_hash);
+			}
+			for (auto i = depth; i > 0; i--)
+			{
+				const auto& sibling = proof.siblings[i - 1];
+				hash = path_bit(path, i - 1) ? inner_hash(sibling, hash) : inner_hash(hash, sibling);
+			}
+			return hash == root;
+		}
+
+		jsondiff::JsonObject ContractStateProof::to_json() const
+		{
+			jsondiff::JsonObject json_obj;
+			json_obj["key"] = key;
+			json_obj["exists"] = exists;
+			json_obj["value"] = value;
+			json_obj["has_other_leaf"] = has_other_leaf;
+			json_obj["other_leaf_path"] = other_leaf_path.str();
+			json_obj["other_leaf_value_hash"] = other_leaf_value_hash.str();
+			jsondiff::JsonArray siblings_array;
+			for (const auto& sibling : siblings)
+			{
+				siblings_array.push_back(sibling.str());
+			}
+			json_obj["siblings"] = siblings_array;
+			json_obj["state_root"] = state_root;
+			return json_obj;
+		}
+
+		ContractStateProof ContractStateProof::from_json(const jsondiff::JsonObject& json_obj)
+		{
+			ContractStateProof proof;
+			proof.key = json_obj["key"].as_string();
+			proof.exists = json_obj["exists"].as_bool();
+			proof.value = json_obj["value"].as_string();
+			proof.has_other_leaf = json_obj["has_other_leaf"].as_bool();
+			proof.other_leaf_path = fcrypto::sha256(json_obj["other_leaf_path"].as_string());
+			proof.other_leaf_value_hash = fcrypto::sha256(json_obj["other_leaf_value_hash"].as_string());
+			auto siblings_array = json_obj["siblings"].as<jsondiff::JsonArray>();
+			for (size_t i = 0; i < siblings_array.size(); i++)
+			{
+				proof.siblings.push_back(fcrypto::sha256(siblings_array[i].as_string()));
+			}
+			proof.state_root = json_obj["state_root"].as_string();
+			return proof;
+		}
+
+		ContractStateTree::Node ContractStateTree::update(size_t depth, const fcrypto::sha256& path, const fcrypto::sha256& value_hash, bool is_remove)
+		{
+			auto node = read_node(depth, path);
+			if (node.type == EMPTY_NODE)
+			{
+				if (is_remove)
+					return node;
+				node.type = LEAF_NODE;
+				node.first = path;
+				node.second = value_hash;
+				write_node(depth, path, node);
+				return node;
+			}
+			if (node.type == LEAF_NODE)
+			{
+				if (node.first == path)
+				{
+					if (is_remove)
+						node = Node();
+					else
+						node.second = value_hash;
+					write_node(depth, path, node);
+					return node;
+				}
+				if (is_remove)
+					return node;
+				Node new_leaf;
+				new_leaf.type = LEAF_NODE;
+				new_leaf.first = path;
+				new_leaf.second = value_hash;
+				return split(depth, node, new_leaf);
+			}
+
+			auto is_right = path_bit(path, depth);
+			const auto& child = update(depth + 1, path, value_hash, is_remove);
+			(is_right ? node.second : node.first) = child.hash();
+			if (is_remove)
+			{
+				// keep a single leaf subtree as the leaf
+				const auto& sibling_hash = is_right ? node.first : node.second;
+				auto sibling_path = path;
+				sibling_path.data()[depth / 8] ^= (char)(0x80 >> (depth % 8));
+				Node lifted;
+				bool lift = false;
+				if (sibling_hash == fcrypto::sha256())
+				{
+					if (child.type != INNER_NODE)
+					{
+						lifted = child;
+						lift = true;
+						write_node(depth + 1, path, Node());
+					}
+				}
+				else if (child.type == EMPTY_NODE)
+				{
+					const auto& sibling = read_node(depth + 1, sibling_path);
+					if (sibling.type == LEAF_NODE)
+					{
+						lifted = sibling;
+						lift = true;
+						write_node(depth + 1, sibling_path, Node());
+					}
+				}
+				if (lift)
+				{
+					write_node(depth, path, lifted);
+					return lifted;
+				}
+			}
+			write_node(depth, path, node);
+			return node;
+		}
+
+		ContractStateTree::Node ContractStateTree::split(size_t depth, const Node& old_leaf, const Node& new_leaf)
+		{
+			const auto& path = new_leaf.first;
+			// paths are different, so they split before path_bits
+			auto split_depth = depth;
+			while (path_bit(old_leaf.first, split_depth) == path_bit(path, split_depth))
+				split_depth++;
+			write_node(split_depth + 1, old_leaf.first, old_leaf);
+			write_node(split_depth + 1, path, new_leaf);
+			Node node;
+			node.type = INNER_NODE;
+			if (path_bit(path, split_depth))
+			{
+				node.first = old_leaf.hash();
+				node.second = new_leaf.hash();
+			}
+			else
+			{
+				node.first = new_leaf.hash();
+				node.second = old_leaf.hash();
+			}
+			write_node(split_depth, path, node);
+			// common prefix is a chain of inner nodes with one empty child
+			for (auto node_depth = split_depth; node_depth > depth; node_depth--)
+			{
+				Node parent;
+				parent.type = INNER_NODE;
+				(path_bit(path, node_depth - 1) ? parent.second : parent.first) = node.hash();
+				write_node(node_depth - 1, path, parent);
+				node = parent;
+			}
+			return node;
+		}
+	}
+}
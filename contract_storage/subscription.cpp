@@ -0,0 +1,74 @@
+#include <contract_storage/subscription.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <boost/exception/all.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		ContractCommitSubscription::ContractCommitSubscription(size_t capacity, ContractSubscriberOverflowPolicy policy)
+			: _slots(capacity), _policy(policy), _head(0), _tail(0), _dropped_count(0), _closed(false), _push_waiting(false)
+		{
+			if (capacity == 0)
+				BOOST_THROW_EXCEPTION(ContractStorageException("subscription queue size can't be 0"));
+		}
+
+		void ContractCommitSubscription::push(const ContractCommitNotificationP& notification)
+		{
+			if (_closed.load(std::memory_order_acquire))
+				return;
+			auto tail = _tail.load(std::memory_order_relaxed);
+			if (tail - _head.load(std::memory_order_acquire) >= _slots.size())
+			{
+				if (_policy == SUBSCRIBER_DROP_NOTIFICATION)
+				{
+					_dropped_count.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				if (_policy == SUBSCRIBER_CLOSE)
+				{
+					close();
+					return;
+				}
+				std::unique_lock<std::mutex> lock(_wait_mutex);
+				// set before reading _head and _closed again, so a pop or close after the reads sees it and notifies
+				_push_waiting.store(true);
+				while (tail - _head.load() >= _slots.size() && !_closed.load())
+					_wait_condition.wait(lock);
+				_push_waiting.store(false);
+				if (_closed.load())
+					return;
+			}
+			_slots[tail % _slots.size()] = notification;
+			_tail.store(tail + 1, std::memory_order_release);
+		}
+
+		bool ContractCommitSubscription::try_pop(ContractCommitNotificationP& notification)
+		{
+			auto head = _head.load(std::memory_order_relaxed);
+			if (head == _tail.load(std::memory_order_acquire))
+				return false;
+			// the slot is released before the producer can reuse it
+			notification = std::move(_slots[head % _slots.size()]);
+			_slots[head % _slots.size()].reset();
+			_head.store(head + 1);
+			wake_push();
+			return true;
+		}
+
+		void ContractCommitSubscription::close()
+		{
+			_closed.store(true);
+			wake_push();
+		}
+
+		void ContractCommitSubscription::wake_push()
+		{
+			if (!_push_waiting.load())
+				return;
+			// the waiting push holds the mutex until it waits, so the notification can't come before the wait
+			std::lock_guard<std::mutex> lock(_wait_mutex);
+			_wait_condition.notify_one();
+		}
+	}
+}
@@ -0,0 +1,86 @@
+#include <contract_storage/undo_log.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <boost/exception/all.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		static const char undo_record_version = 1;
+
+		static void write_varint(std::string& out, uint64_t value)
+		{
+			while (value >= 0x80)
+			{
+				out.push_back((char)((value & 0x7f) | 0x80));
+				value >>= 7;
+			}
+			out.push_back((char)value);
+		}
+
+		static uint64_t read_varint(const std::string& data, size_t& pos)
+		{
+			uint64_t value = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				if (pos >= data.size())
+					BOOST_THROW_EXCEPTION(ContractStorageException("undo record format error"));
+				auto byte = (unsigned char)data[pos++];
+				value |= (uint64_t)(byte & 0x7f) << shift;
+				if (!(byte & 0x80))
+					return value;
+			}
+			BOOST_THROW_EXCEPTION(ContractStorageException("undo record format error"));
+		}
+
+		static std::string read_bytes(const std::string& data, size_t& pos)
+		{
+			auto size = read_varint(data, pos);
+			if (size > data.size() - pos)
+				BOOST_THROW_EXCEPTION(ContractStorageException("undo record format error"));
+			std::string bytes(data, pos, size);
+			pos += size;
+			return bytes;
+		}
+
+		std::string encode_undo_items(const std::vector<ContractUndoItem>& items)
+		{
+			std::string out;
+			out.push_back(undo_record_version);
+			write_varint(out, items.size());
+			for (const auto& item : items)
+			{
+				write_varint(out, item.key.size());
+				out.append(item.key);
+				out.push_back(item.existed ? 1 : 0);
+				if (item.existed)
+				{
+					write_varint(out, item.value.size());
+					out.append(item.value);
+				}
+			}
+			return out;
+		}
+
+		std::vector<ContractUndoItem> decode_undo_items(const std::string& data)
+		{
+			if (data.empty() || data[0] != undo_record_version)
+				BOOST_THROW_EXCEPTION(ContractStorageException("not supported undo record version"));
+			size_t pos = 1;
+			auto count = read_varint(data, pos);
+			std::vector<ContractUndoItem> items;
+			for (uint64_t i = 0; i < count; i++)
+			{
+				ContractUndoItem item;
+				item.key = read_bytes(data, pos);
+				if (pos >= data.size())
+					BOOST_THROW_EXCEPTION(ContractStorageException("undo record format error"));
+				item.existed = data[pos++] != 0;
+				if (item.existed)
+					item.value = read_bytes(data, pos);
+				items.push_back(item);
+			}
+			return items;
+		}
+	}
+}
@@ -0,0 +1,81 @@
+#include <contract_storage/write_set.hpp>
+#include <contract_storage/exceptions.hpp>
+#include <boost/exception/all.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		ContractWriteSet::ContractWriteSet(leveldb::DB* db, const leveldb::Snapshot* snapshot)
+			: _db(db), _snapshot(snapshot)
+		{
+		}
+
+		bool ContractWriteSet::get(const std::string& key, std::string* value) const
+		{
+			auto it = _items.find(key);
+			if (it != _items.end())
+			{
+				if (it->second.deleted)
+					return false;
+				*value = it->second.value;
+				return true;
+			}
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = _snapshot;
+			return _db->Get(read_options, key, value).ok();
+		}
+
+		ContractWriteSetItem& ContractWriteSet::touch(const std::string& key)
+		{
+			auto it = _items.find(key);
+			if (it != _items.end())
+				return it->second;
+			auto& item = _items[key];
+			leveldb::ReadOptions read_options;
+			read_options.snapshot = _snapshot;
+			auto status = _db->Get(read_options, key, &item.old_value);
+			if (!status.ok() && !status.IsNotFound())
+				BOOST_THROW_EXCEPTION(ContractStorageException(std::string("read key ") + key + " error"));
+			item.existed = status.ok();
+			return item;
+		}
+
+		void ContractWriteSet::put(const std::string& key, const std::string& value)
+		{
+			auto& item = touch(key);
+			_write_count++;
+			item.deleted = false;
+			item.value = value;
+		}
+
+		void ContractWriteSet::remove(const std::string& key)
+		{
+			auto& item = touch(key);
+			_write_count++;
+			item.deleted = true;
+			item.value.clear();
+		}
+
+		std::vector<std::string> ContractWriteSet::changed_keys() const
+		{
+			std::vector<std::string> keys;
+			for (const auto& p : _items)
+			{
+				keys.push_back(p.first);
+			}
+			return keys;
+		}
+
+		void ContractWriteSet::write_to(leveldb::WriteBatch* batch) const
+		{
+			for (const auto& p : _items)
+			{
+				if (p.second.deleted)
+					batch->Delete(p.first);
+				else
+					batch->Put(p.first, p.second.value);
+			}
+		}
+	}
+}
@@ -1,6 +1,5 @@
 #include <fjson/crypto/hex.hpp>
 #include <fjson/fwd_impl.hpp>
-#include <openssl/sha.h>
 #include <string.h>
 #include <fcrypto/sha1.hpp>
 #include <fjson/variant.hpp>
@@ -25,7 +24,7 @@ char* sha1::data()const { return (char*)&_hash[0]; }
 
 
 struct sha1::encoder::impl {
-   SHA_CTX ctx;
+   detail::sha1_ctx ctx;
 };
 
 sha1::encoder::~encoder() {}
@@ -43,15 +42,15 @@ sha1 sha1::hash( const string& s ) {
 }
 
 void sha1::encoder::write( const char* d, uint32_t dlen ) {
-  SHA1_Update( &my->ctx, d, dlen); 
+  detail::sha1_update( my->ctx, d, dlen );
 }
 sha1 sha1::encoder::result() {
   sha1 h;
-  SHA1_Final((uint8_t*)h.data(), &my->ctx );
+  detail::sha1_final( my->ctx, h.data() );
   return h;
 }
 void sha1::encoder::reset() {
-  SHA1_Init( &my->ctx);  
+  detail::sha1_init( my->ctx );
 }
 
 sha1 operator << ( const sha1& h1, uint32_t i ) {
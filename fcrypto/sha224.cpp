@@ -1,7 +1,6 @@
 #include <fjson/crypto/hex.hpp>
 #include <fcrypto/hmac.hpp>
 #include <fjson/fwd_impl.hpp>
-#include <openssl/sha.h>
 #include <string.h>
 #include <fcrypto/sha224.hpp>
 #include <fjson/variant.hpp>
@@ -24,7 +23,7 @@ namespace fcrypto {
 
 
     struct sha224::encoder::impl {
-       SHA256_CTX ctx;
+       detail::sha256_ctx ctx;
     };
 
     sha224::encoder::~encoder() {}
@@ -42,15 +41,15 @@ namespace fcrypto {
     }
 
     void sha224::encoder::write( const char* d, uint32_t dlen ) {
-      SHA224_Update( &my->ctx, d, dlen); 
+      detail::sha256_update( my->ctx, d, dlen );
     }
     sha224 sha224::encoder::result() {
       sha224 h;
-      SHA224_Final((uint8_t*)h.data(), &my->ctx );
+      detail::sha256_final( my->ctx, h.data(), sizeof(h._hash) );
       return h;
     }
     void sha224::encoder::reset() {
-      SHA224_Init( &my->ctx);  
+      detail::sha224_init( my->ctx );
     }
 
     sha224 operator << ( const sha224& h1, uint32_t i ) {
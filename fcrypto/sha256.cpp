@@ -1,7 +1,6 @@
 #include <fjson/crypto/hex.hpp>
 #include <fcrypto/hmac.hpp>
 #include <fjson/fwd_impl.hpp>
-#include <openssl/sha.h>
 #include <string.h>
 #include <fcrypto/sha256.hpp>
 #include <fjson/variant.hpp>
@@ -30,7 +29,7 @@ namespace fcrypto {
 
 
     struct sha256::encoder::impl {
-       SHA256_CTX ctx;
+       detail::sha256_ctx ctx;
     };
 
     sha256::encoder::~encoder() {}
@@ -54,15 +53,15 @@ namespace fcrypto {
     }
 
     void sha256::encoder::write( const char* d, uint32_t dlen ) {
-      SHA256_Update( &my->ctx, d, dlen); 
+      detail::sha256_update( my->ctx, d, dlen );
     }
     sha256 sha256::encoder::result() {
       sha256 h;
-      SHA256_Final((uint8_t*)h.data(), &my->ctx );
+      detail::sha256_final( my->ctx, h.data(), sizeof(h._hash) );
       return h;
     }
     void sha256::encoder::reset() {
-      SHA256_Init( &my->ctx);  
+      detail::sha256_init( my->ctx );
     }
 
     sha256 operator << ( const sha256& h1, uint32_t i ) {
@@ -0,0 +1,231 @@
+#include <fcrypto/sha256.hpp>
+#include <fcrypto/sha_backend.hpp>
+#include <string.h>
+#include <atomic>
+#include "fcrypto/_digest_common.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define FCRYPTO_SHA256_MANY_AVX2
+#endif
+
+namespace fcrypto {
+
+  namespace detail {
+
+    static const uint32_t sha256_iv[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    static inline uint32_t load_be32( const unsigned char* p ) {
+      return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+
+    static inline void store_be32( unsigned char* p, uint32_t v ) {
+      p[0] = (unsigned char)(v >> 24);
+      p[1] = (unsigned char)(v >> 16);
+      p[2] = (unsigned char)(v >> 8);
+      p[3] = (unsigned char)v;
+    }
+
+    // one message being hashed in a lane. full blocks are read in place, the padded
+    // last one or two blocks are built in tail
+    struct sha256_lane {
+      size_t               message;
+      const unsigned char* data;
+      uint64_t             full_blocks;
+      uint64_t             blocks;
+      uint64_t             next_block;
+      unsigned char        tail[128];
+
+      void init( size_t msg, const char* d, uint32_t dlen ) {
+        message = msg;
+        data = (const unsigned char*)d;
+        full_blocks = dlen / 64;
+        size_t rest = dlen % 64;
+        size_t tail_blocks = rest + 9 <= 64 ? 1 : 2;
+        blocks = full_blocks + tail_blocks;
+        next_block = 0;
+        memset( tail, 0, sizeof(tail) );
+        if( rest )
+          memcpy( tail, data + full_blocks * 64, rest );
+        tail[rest] = 0x80;
+        uint64_t bits = (uint64_t)dlen * 8;
+        unsigned char* length_pos = tail + tail_blocks * 64 - 8;
+        store_be32( length_pos, (uint32_t)(bits >> 32) );
+        store_be32( length_pos + 4, (uint32_t)bits );
+      }
+
+      const unsigned char* block()const {
+        return next_block < full_blocks ? data + next_block * 64 : tail + (next_block - full_blocks) * 64;
+      }
+    };
+
+#ifdef FCRYPTO_SHA256_MANY_AVX2
+    static const size_t sha256_lanes = 8;
+    // fewer messages leave most lanes empty, the single buffer path is faster then
+    static const size_t sha256_many_min_count = 4;
+
+#define FCRYPTO_ROTR32X8( x, n ) _mm256_or_si256( _mm256_srli_epi32( (x), (n) ), _mm256_slli_epi32( (x), 32 - (n) ) )
+
+    // compress one block of every lane, state is [word][lane]
+    __attribute__((target("avx2")))
+    static void sha256_compress_avx2( uint32_t state[8][sha256_lanes], const unsigned char* blocks[sha256_lanes] ) {
+      __m256i w[16];
+      for( size_t t = 0; t < 16; ++t ) {
+        w[t] = _mm256_setr_epi32( (int)load_be32( blocks[0] + 4 * t ), (int)load_be32( blocks[1] + 4 * t ),
+                                  (int)load_be32( blocks[2] + 4 * t ), (int)load_be32( blocks[3] + 4 * t ),
+                                  (int)load_be32( blocks[4] + 4 * t ), (int)load_be32( blocks[5] + 4 * t ),
+                                  (int)load_be32( blocks[6] + 4 * t ), (int)load_be32( blocks[7] + 4 * t ) );
+      }
+      __m256i a = _mm256_loadu_si256( (const __m256i*)state[0] );
+      __m256i b = _mm256_loadu_si256( (const __m256i*)state[1] );
+      __m256i c = _mm256_loadu_si256( (const __m256i*)state[2] );
+      __m256i d = _mm256_loadu_si256( (const __m256i*)state[3] );
+      __m256i e = _mm256_loadu_si256( (const __m256i*)state[4] );
+      __m256i f = _mm256_loadu_si256( (const __m256i*)state[5] );
+      __m256i g = _mm256_loadu_si256( (const __m256i*)state[6] );
+      __m256i h = _mm256_loadu_si256( (const __m256i*)state[7] );
+      for( size_t t = 0; t < 64; ++t ) {
+        if( t >= 16 ) {
+          __m256i w15 = w[(t - 15) & 15];
+          __m256i w2 = w[(t - 2) & 15];
+          __m256i s0 = _mm256_xor_si256( _mm256_xor_si256( FCRYPTO_ROTR32X8( w15, 7 ), FCRYPTO_ROTR32X8( w15, 18 ) ), _mm256_srli_epi32( w15, 3 ) );
+          __m256i s1 = _mm256_xor_si256( _mm256_xor_si256( FCRYPTO_ROTR32X8( w2, 17 ), FCRYPTO_ROTR32X8( w2, 19 ) ), _mm256_srli_epi32( w2, 10 ) );
+          w[t & 15] = _mm256_add_epi32( _mm256_add_epi32( w[t & 15], s0 ), _mm256_add_epi32( w[(t - 7) & 15], s1 ) );
+        }
+        __m256i big_s1 = _mm256_xor_si256( _mm256_xor_si256( FCRYPTO_ROTR32X8( e, 6 ), FCRYPTO_ROTR32X8( e, 11 ) ), FCRYPTO_ROTR32X8( e, 25 ) );
+        __m256i ch = _mm256_xor_si256( _mm256_and_si256( e, f ), _mm256_andnot_si256( e, g ) );
+        __m256i temp1 = _mm256_add_epi32( _mm256_add_epi32( h, big_s1 ),
+                                          _mm256_add_epi32( ch, _mm256_add_epi32( _mm256_set1_epi32( (int)sha256_k[t] ), w[t & 15] ) ) );
+        __m256i big_s0 = _mm256_xor_si256( _mm256_xor_si256( FCRYPTO_ROTR32X8( a, 2 ), FCRYPTO_ROTR32X8( a, 13 ) ), FCRYPTO_ROTR32X8( a, 22 ) );
+        __m256i maj = _mm256_xor_si256( _mm256_xor_si256( _mm256_and_si256( a, b ), _mm256_and_si256( a, c ) ), _mm256_and_si256( b, c ) );
+        __m256i temp2 = _mm256_add_epi32( big_s0, maj );
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32( d, temp1 );
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32( temp1, temp2 );
+      }
+      __m256i* out = (__m256i*)state;
+      _mm256_storeu_si256( out + 0, _mm256_add_epi32( _mm256_loadu_si256( out + 0 ), a ) );
+      _mm256_storeu_si256( out + 1, _mm256_add_epi32( _mm256_loadu_si256( out + 1 ), b ) );
+      _mm256_storeu_si256( out + 2, _mm256_add_epi32( _mm256_loadu_si256( out + 2 ), c ) );
+      _mm256_storeu_si256( out + 3, _mm256_add_epi32( _mm256_loadu_si256( out + 3 ), d ) );
+      _mm256_storeu_si256( out + 4, _mm256_add_epi32( _mm256_loadu_si256( out + 4 ), e ) );
+      _mm256_storeu_si256( out + 5, _mm256_add_epi32( _mm256_loadu_si256( out + 5 ), f ) );
+      _mm256_storeu_si256( out + 6, _mm256_add_epi32( _mm256_loadu_si256( out + 6 ), g ) );
+      _mm256_storeu_si256( out + 7, _mm256_add_epi32( _mm256_loadu_si256( out + 7 ), h ) );
+    }
+
+#undef FCRYPTO_ROTR32X8
+
+    static bool cpu_supports_avx2() {
+      static const bool supported = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports( "avx2" ) != 0;
+      }();
+      return supported;
+    }
+
+    // every lane takes the next message when its current one is done, so lanes stay busy with mixed sizes
+    static void sha256_hash_many_avx2( const char* const* datas, const uint32_t* sizes, size_t count, sha256* results ) {
+      static const unsigned char empty_block[64] = { 0 };
+      sha256_lane lanes[sha256_lanes];
+      bool active[sha256_lanes] = { false };
+      uint32_t state[8][sha256_lanes];
+      const unsigned char* blocks[sha256_lanes];
+      size_t next_message = 0;
+      for( ;; ) {
+        size_t active_count = 0;
+        for( size_t l = 0; l < sha256_lanes; ++l ) {
+          if( !active[l] && next_message < count ) {
+            lanes[l].init( next_message, datas[next_message], sizes[next_message] );
+            for( size_t i = 0; i < 8; ++i )
+              state[i][l] = sha256_iv[i];
+            active[l] = true;
+            ++next_message;
+          }
+          if( active[l] )
+            ++active_count;
+          blocks[l] = active[l] ? lanes[l].block() : empty_block;
+        }
+        if( active_count == 0 )
+          break;
+        sha256_compress_avx2( state, blocks );
+        for( size_t l = 0; l < sha256_lanes; ++l ) {
+          if( !active[l] || ++lanes[l].next_block < lanes[l].blocks )
+            continue;
+          unsigned char* out = (unsigned char*)results[lanes[l].message].data();
+          for( size_t i = 0; i < 8; ++i )
+            store_be32( out + 4 * i, state[i][l] );
+          active[l] = false;
+        }
+      }
+    }
+#endif
+
+    static std::atomic<int>& current_many_backend() {
+      static std::atomic<int> backend( (int)sha256_many_backend::automatic );
+      return backend;
+    }
+
+  } // detail
+
+  sha256_many_backend current_sha256_many_backend() {
+    return (sha256_many_backend)detail::current_many_backend().load();
+  }
+
+  bool set_sha256_many_backend( sha256_many_backend backend ) {
+    if( !sha256_many_backend_supported( backend ) )
+      return false;
+    detail::current_many_backend().store( (int)backend );
+    return true;
+  }
+
+  bool sha256_many_backend_supported( sha256_many_backend backend ) {
+    switch( backend ) {
+      case sha256_many_backend::automatic:
+      case sha256_many_backend::single:
+        return true;
+      case sha256_many_backend::avx2:
+#ifdef FCRYPTO_SHA256_MANY_AVX2
+        return detail::cpu_supports_avx2();
+#else
+        return false;
+#endif
+    }
+    return false;
+  }
+
+  void sha256::hash_many( const char* const* datas, const uint32_t* sizes, size_t count, sha256* results ) {
+#ifdef FCRYPTO_SHA256_MANY_AVX2
+    auto backend = (sha256_many_backend)detail::current_many_backend().load( std::memory_order_relaxed );
+    // cpus with sha extensions hash one message at a time faster than 8 avx2 lanes, so does openssl on them
+    if( backend == sha256_many_backend::avx2
+        || ( backend == sha256_many_backend::automatic && count >= detail::sha256_many_min_count
+             && detail::cpu_supports_avx2() && !sha_backend_supported( sha_backend::sha_ni ) ) ) {
+      detail::sha256_hash_many_avx2( datas, sizes, count, results );
+      return;
+    }
+#endif
+    for( size_t i = 0; i < count; ++i )
+      results[i] = hash( datas[i], sizes[i] );
+  }
+
+  std::vector<sha256> sha256::hash_many( const std::vector<string>& messages ) {
+    std::vector<const char*> datas( messages.size() );
+    std::vector<uint32_t> sizes( messages.size() );
+    for( size_t i = 0; i < messages.size(); ++i ) {
+      datas[i] = messages[i].data();
+      sizes[i] = (uint32_t)messages[i].size();
+    }
+    std::vector<sha256> results( messages.size() );
+    hash_many( datas.data(), sizes.data(), messages.size(), results.data() );
+    return results;
+  }
+
+} // fcrypto
@@ -0,0 +1,273 @@
+#include <fcrypto/sha_backend.hpp>
+#include <openssl/sha.h>
+#include <string.h>
+#include <atomic>
+#include "fcrypto/_digest_common.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define FCRYPTO_SHA_NI
+#endif
+
+namespace fcrypto {
+
+  namespace detail {
+
+    const uint32_t sha256_k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    typedef void (*sha_blocks_fn)( uint32_t* state, const unsigned char* data, size_t blocks );
+
+    static void sha1_blocks_openssl( uint32_t* state, const unsigned char* data, size_t blocks ) {
+      SHA_CTX c;
+      c.h0 = state[0];
+      c.h1 = state[1];
+      c.h2 = state[2];
+      c.h3 = state[3];
+      c.h4 = state[4];
+      for( size_t i = 0; i < blocks; ++i )
+        SHA1_Transform( &c, data + i * 64 );
+      state[0] = c.h0;
+      state[1] = c.h1;
+      state[2] = c.h2;
+      state[3] = c.h3;
+      state[4] = c.h4;
+    }
+
+    static void sha256_blocks_openssl( uint32_t* state, const unsigned char* data, size_t blocks ) {
+      SHA256_CTX c;
+      memcpy( c.h, state, sizeof(c.h) );
+      for( size_t i = 0; i < blocks; ++i )
+        SHA256_Transform( &c, data + i * 64 );
+      memcpy( state, c.h, sizeof(c.h) );
+    }
+
+#ifdef FCRYPTO_SHA_NI
+    __attribute__((target("sha,sse4.1")))
+    static void sha1_blocks_sha_ni( uint32_t* state, const unsigned char* data, size_t blocks ) {
+      const __m128i mask = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+      __m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)state ), 0x1b );
+      __m128i e0 = _mm_set_epi32( (int)state[4], 0, 0, 0 );
+      for( size_t block = 0; block < blocks; ++block, data += 64 ) {
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+        // w[g & 3] is the message of rounds 4g..4g+3, or the partial schedule of a later group
+        __m128i w[4];
+        __m128i e_last = abcd;
+#pragma GCC unroll 20
+        for( int g = 0; g < 20; ++g ) {
+          if( g < 4 )
+            w[g] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(data + 16 * g) ), mask );
+          else
+            w[g & 3] = _mm_sha1msg2_epu32( w[g & 3], w[(g - 1) & 3] );
+          __m128i e = g == 0 ? _mm_add_epi32( e0, w[0] ) : _mm_sha1nexte_epu32( e_last, w[g & 3] );
+          e_last = abcd;
+          switch( g / 5 ) {
+            case 0: abcd = _mm_sha1rnds4_epu32( abcd, e, 0 ); break;
+            case 1: abcd = _mm_sha1rnds4_epu32( abcd, e, 1 ); break;
+            case 2: abcd = _mm_sha1rnds4_epu32( abcd, e, 2 ); break;
+            default: abcd = _mm_sha1rnds4_epu32( abcd, e, 3 ); break;
+          }
+          if( g >= 1 && g <= 16 )
+            w[(g - 1) & 3] = _mm_sha1msg1_epu32( w[(g - 1) & 3], w[g & 3] );
+          if( g >= 2 && g <= 17 )
+            w[(g - 2) & 3] = _mm_xor_si128( w[(g - 2) & 3], w[g & 3] );
+        }
+        e0 = _mm_sha1nexte_epu32( e_last, e0_save );
+        abcd = _mm_add_epi32( abcd, abcd_save );
+      }
+      _mm_storeu_si128( (__m128i*)state, _mm_shuffle_epi32( abcd, 0x1b ) );
+      state[4] = (uint32_t)_mm_extract_epi32( e0, 3 );
+    }
+
+    __attribute__((target("sha,sse4.1")))
+    static void sha256_blocks_sha_ni( uint32_t* state, const unsigned char* data, size_t blocks ) {
+      const __m128i mask = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+      __m128i tmp = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)&state[0] ), 0xb1 ); // cdab
+      __m128i state1 = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)&state[4] ), 0x1b ); // efgh
+      __m128i state0 = _mm_alignr_epi8( tmp, state1, 8 ); // abef
+      state1 = _mm_blend_epi16( state1, tmp, 0xf0 ); // cdgh
+      for( size_t block = 0; block < blocks; ++block, data += 64 ) {
+        const __m128i abef_save = state0;
+        const __m128i cdgh_save = state1;
+        // w[g & 3] is the message of rounds 4g..4g+3
+        __m128i w[4];
+#pragma GCC unroll 16
+        for( int g = 0; g < 16; ++g ) {
+          if( g < 4 )
+            w[g] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(data + 16 * g) ), mask );
+          else
+            w[g & 3] = _mm_sha256msg2_epu32( _mm_add_epi32( _mm_sha256msg1_epu32( w[g & 3], w[(g + 1) & 3] ),
+                                                            _mm_alignr_epi8( w[(g + 3) & 3], w[(g + 2) & 3], 4 ) ), w[(g + 3) & 3] );
+          __m128i msg = _mm_add_epi32( w[g & 3], _mm_loadu_si128( (const __m128i*)&sha256_k[4 * g] ) );
+          state1 = _mm_sha256rnds2_epu32( state1, state0, msg );
+          state0 = _mm_sha256rnds2_epu32( state0, state1, _mm_shuffle_epi32( msg, 0x0e ) );
+        }
+        state0 = _mm_add_epi32( state0, abef_save );
+        state1 = _mm_add_epi32( state1, cdgh_save );
+      }
+      tmp = _mm_shuffle_epi32( state0, 0x1b ); // feba
+      state1 = _mm_shuffle_epi32( state1, 0xb1 ); // dchg
+      _mm_storeu_si128( (__m128i*)&state[0], _mm_blend_epi16( tmp, state1, 0xf0 ) ); // dcba
+      _mm_storeu_si128( (__m128i*)&state[4], _mm_alignr_epi8( state1, tmp, 8 ) ); // hgfe
+    }
+
+    static bool cpu_supports_sha_ni() {
+      static const bool supported = []() {
+        __builtin_cpu_init();
+        unsigned int eax, ebx, ecx, edx;
+        // sha extensions are leaf 7 ebx bit 29
+        if( !__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+          return false;
+        return (ebx & (1u << 29)) != 0 && __builtin_cpu_supports( "sse4.1" ) != 0;
+      }();
+      return supported;
+    }
+#endif
+
+    static std::atomic<int>& current_backend() {
+      static std::atomic<int> backend( (int)(sha_backend_supported( sha_backend::sha_ni ) ? sha_backend::sha_ni : sha_backend::openssl) );
+      return backend;
+    }
+
+    static sha_blocks_fn sha1_blocks() {
+#ifdef FCRYPTO_SHA_NI
+      if( current_backend().load( std::memory_order_relaxed ) == (int)sha_backend::sha_ni )
+        return sha1_blocks_sha_ni;
+#endif
+      return sha1_blocks_openssl;
+    }
+
+    static sha_blocks_fn sha256_blocks() {
+#ifdef FCRYPTO_SHA_NI
+      if( current_backend().load( std::memory_order_relaxed ) == (int)sha_backend::sha_ni )
+        return sha256_blocks_sha_ni;
+#endif
+      return sha256_blocks_openssl;
+    }
+
+    template<size_t Words>
+    static void sha_update( sha_ctx<Words>& ctx, const char* d, size_t dlen, sha_blocks_fn blocks ) {
+      const unsigned char* data = (const unsigned char*)d;
+      size_t buffered = ctx.length % 64;
+      ctx.length += dlen;
+      if( buffered ) {
+        size_t n = 64 - buffered;
+        if( dlen < n ) {
+          memcpy( ctx.buffer + buffered, data, dlen );
+          return;
+        }
+        memcpy( ctx.buffer + buffered, data, n );
+        blocks( ctx.h, ctx.buffer, 1 );
+        data += n;
+        dlen -= n;
+      }
+      if( dlen >= 64 ) {
+        blocks( ctx.h, data, dlen / 64 );
+        data += dlen / 64 * 64;
+        dlen %= 64;
+      }
+      if( dlen )
+        memcpy( ctx.buffer, data, dlen );
+    }
+
+    // pad with 0x80, zeros and big endian bit length, then write the first out_size bytes of state big endian
+    template<size_t Words>
+    static void sha_final( sha_ctx<Words>& ctx, char* out, size_t out_size, sha_blocks_fn blocks ) {
+      uint64_t bits = ctx.length * 8;
+      size_t buffered = ctx.length % 64;
+      ctx.buffer[buffered++] = 0x80;
+      if( buffered > 56 ) {
+        memset( ctx.buffer + buffered, 0, 64 - buffered );
+        blocks( ctx.h, ctx.buffer, 1 );
+        buffered = 0;
+      }
+      memset( ctx.buffer + buffered, 0, 56 - buffered );
+      for( size_t i = 0; i < 8; ++i )
+        ctx.buffer[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+      blocks( ctx.h, ctx.buffer, 1 );
+      for( size_t i = 0; i < out_size; ++i )
+        out[i] = (char)(ctx.h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+
+    void sha1_init( sha1_ctx& ctx ) {
+      static const uint32_t iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+      memcpy( ctx.h, iv, sizeof(iv) );
+      ctx.length = 0;
+    }
+
+    void sha1_update( sha1_ctx& ctx, const char* d, size_t dlen ) {
+      sha_update( ctx, d, dlen, sha1_blocks() );
+    }
+
+    void sha1_final( sha1_ctx& ctx, char* out ) {
+      sha_final( ctx, out, 20, sha1_blocks() );
+    }
+
+    void sha256_init( sha256_ctx& ctx ) {
+      static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+      memcpy( ctx.h, iv, sizeof(iv) );
+      ctx.length = 0;
+    }
+
+    void sha224_init( sha256_ctx& ctx ) {
+      static const uint32_t iv[8] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4 };
+      memcpy( ctx.h, iv, sizeof(iv) );
+      ctx.length = 0;
+    }
+
+    void sha256_update( sha256_ctx& ctx, const char* d, size_t dlen ) {
+      sha_update( ctx, d, dlen, sha256_blocks() );
+    }
+
+    void sha256_final( sha256_ctx& ctx, char* out, size_t out_size ) {
+      sha_final( ctx, out, out_size, sha256_blocks() );
+    }
+
+  } // detail
+
+  sha_backend current_sha_backend() {
+    return (sha_backend)detail::current_backend().load();
+  }
+
+  bool set_sha_backend( sha_backend backend ) {
+    if( !sha_backend_supported( backend ) )
+      return false;
+    detail::current_backend().store( (int)backend );
+    return true;
+  }
+
+  bool sha_backend_supported( sha_backend backend ) {
+    switch( backend ) {
+      case sha_backend::openssl:
+        return true;
+      case sha_backend::sha_ni:
+#ifdef FCRYPTO_SHA_NI
+        return detail::cpu_supports_sha_ni();
+#else
+        return false;
+#endif
+    }
+    return false;
+  }
+
+  const char* sha_backend_name( sha_backend backend ) {
+    switch( backend ) {
+      case sha_backend::openssl:
+        return "openssl";
+      case sha_backend::sha_ni:
+        return "sha_ni";
+    }
+    return "unknown";
+  }
+
+} // fcrypto
@@ -14,10 +14,33 @@ namespace contract
 			ContractCommitId commit_id;
 			std::string contract_id; // when is contract info change
 			std::string change_type;
+			uint32_t block_height = 0;
+			std::string state_root; // hex root of state tree after the commit, empty when state tree disabled
+			uint64_t keys_written = 0; // contract info, storage and name mapping keys changed by the commit
+			uint64_t diff_size = 0; // bytes of the saved commit diff
 		};
 
 		typedef std::shared_ptr<ContractCommitInfo> ContractCommitInfoP;
 
+		// totals of commits in a block height range, read from commit_info only
+		struct ContractCommitsSummary
+		{
+			uint64_t commits_count = 0;
+			uint64_t keys_written = 0;
+			uint64_t diff_size = 0;
+		};
+
+		// full leveldb image saved after a commit, deep rollback restores it instead of rollbacking all newer commits
+		struct ContractCheckpointInfo
+		{
+			uint64_t id;
+			uint64_t commit_seq; // id of the commit in commit_info
+			ContractCommitId commit_id;
+			uint32_t block_height;
+			uint64_t keys_count;
+			std::string path;
+		};
+
 #define EMPTY_COMMIT_ID ""
 
 		// to ensure commitId unique and reproducible, use outside commitId. you can store commitId in blockchain
@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <contract_storage/commit.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		// commit_info rows in memory by commit id and in commit seq order. only the thread using the service changes it,
+		// except the pruning thread marking pruned seqs
+		class ContractCommitIndex
+		{
+		private:
+			std::unordered_map<ContractCommitId, ContractCommitInfo> _by_commit_id;
+			std::map<uint64_t, ContractCommitId> _by_seq;
+			// commits with seq <= it are pruned from commit_info
+			std::atomic<uint64_t> _pruned_seq;
+
+			void erase_pruned();
+		public:
+			ContractCommitIndex();
+
+			void clear();
+			void add(const ContractCommitInfo& commit_info);
+			// remove commits with seq > commit_seq
+			void remove_after(uint64_t commit_seq);
+			// called by the pruning thread after deleting commits with seq <= commit_seq
+			void mark_pruned(uint64_t commit_seq);
+
+			// nullptr when not found or pruned, valid until the index changes
+			const ContractCommitInfo* find(const ContractCommitId& commit_id) const;
+			// nullptr when not found or pruned, valid until the index changes
+			const ContractCommitInfo* find_seq(uint64_t commit_seq) const;
+			// commit with the max seq, nullptr when no commit
+			const ContractCommitInfo* top() const;
+			// commits with seq > commit_seq, newest first
+			std::vector<ContractCommitInfo> after(uint64_t commit_seq) const;
+			size_t size() const { return _by_seq.size(); }
+		};
+	}
+}
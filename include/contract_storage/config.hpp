@@ -1,9 +1,81 @@
 #pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
 
 namespace contract
 {
 	namespace storage
 	{
+		// pragmas of sqlite connections, applied on open and by set_options
+		struct ContractSqliteOptions
+		{
+			// PRAGMA journal_mode, WAL needs fewer fsyncs per commit than the rollback journal(DELETE)
+			std::string journal_mode = "DELETE";
+			// PRAGMA synchronous: OFF, NORMAL, FULL or EXTRA. with WAL, NORMAL keeps the db consistent but may lose the last commits on power loss
+			std::string synchronous = "FULL";
+			// PRAGMA cache_size, pages when positive, KiB when negative
+			int64_t cache_size = -2000;
+			// PRAGMA mmap_size in bytes, 0 disables memory mapped io
+			int64_t mmap_size = 0;
+			// the background pruning uses its own connection, so both connections wait for the other's write lock
+			int busy_timeout_ms = 10000;
 
+			// rollback journal with full fsyncs, sqlite defaults
+			static ContractSqliteOptions durable()
+			{
+				return ContractSqliteOptions();
+			}
+
+			// WAL without fsync on every commit, 64MiB cache and 256MiB mmap
+			static ContractSqliteOptions fast()
+			{
+				ContractSqliteOptions options;
+				options.journal_mode = "WAL";
+				options.synchronous = "NORMAL";
+				options.cache_size = -64 * 1024;
+				options.mmap_size = 256 * 1024 * 1024;
+				return options;
+			}
+		};
+
+		struct ContractStorageOptions
+		{
+			// threads used to prepare non-conflicting change sets of commit_contract_changes_batch, 0 means hardware concurrency
+			size_t commit_prepare_threads = 0;
+			// threads used to scan the whole state or verify the whole history, 0 means hardware concurrency
+			size_t state_scan_threads = 0;
+			// write each key once when rolling back many commits, false writes the restored keys commit by commit
+			bool coalesce_rollback_writes = true;
+
+			// save a full state checkpoint when block height passed last checkpoint's by this interval, 0 disables checkpoints
+			uint32_t checkpoint_interval_blocks = 0;
+			// oldest checkpoints are removed when more are saved
+			size_t max_checkpoints = 3;
+			// estimated keys rewritten when rollback one commit, to choose between replaying commits and restoring a checkpoint
+			uint64_t rollback_keys_per_commit = 16;
+
+			// finalize commits of blocks older than current block height minus this, 0 keeps all history rollbackable
+			uint32_t keep_last_blocks = 0;
+			// delete events of pruned commits too, otherwise only their diffs and undo records are deleted
+			bool prune_events = false;
+			// commits of this many blocks share an aggregated event bloom, letting event queries skip the whole range.
+			// 0 only keeps the bloom of each commit
+			uint32_t event_bloom_range_blocks = 1024;
+			// prune finalized history in a background thread, otherwise only prune_history does
+			bool background_pruning = true;
+			// commits pruned in one batch
+			size_t prune_batch_commits = 1000;
+
+			// keep a sparse merkle tree over contract infos(with balances) and storages, its root is saved with each commit.
+			// enabling it on existing state builds the tree in next commit, disabling it drops the tree
+			bool state_tree = false;
+
+			// chain commit ids from raw bytes and save them as 32 bytes in leveldb and sqlite instead of 64 hex chars.
+			// only used by a db without commits, dbs committed before keep their format, hex ids reproduce the old chain
+			bool binary_commit_ids = false;
+
+			ContractSqliteOptions sqlite = ContractSqliteOptions::durable();
+		};
 	}
-}
\ No newline at end of file
+}
@@ -3,7 +3,14 @@
 #include <contract_storage/config.hpp>
 #include <contract_storage/contract_info.hpp>
 #include <contract_storage/commit.hpp>
+#include <contract_storage/commit_index.hpp>
 #include <contract_storage/change.hpp>
+#include <contract_storage/write_set.hpp>
+#include <contract_storage/state_tree.hpp>
+#include <contract_storage/state_set_hash.hpp>
+#include <contract_storage/event_log.hpp>
+#include <contract_storage/event_bloom.hpp>
+#include <contract_storage/subscription.hpp>
 #include <boost/exception/all.hpp>
 #include <fjson/array.hpp>
 #include <fcrypto/ripemd160.hpp>
@@ -13,6 +20,12 @@
 #include <boost/uuid/sha1.hpp>
 #include <exception>
 #include <memory>
+#include <functional>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <leveldb/db.h>
 #include <sqlite3.h>
 
@@ -20,6 +33,59 @@ namespace contract
 {
 	namespace storage
 	{
+		struct PreparedContractChanges;
+
+		struct ContractRollbackStats
+		{
+			uint64_t commits_count = 0;
+			// writes of rolling back commit by commit, a key restored by n commits counts n times
+			uint64_t key_writes = 0;
+			// keys actually written after merging the changes of all rollbacked commits
+			uint64_t keys_written = 0;
+
+			uint64_t writes_saved() const { return key_writes - keys_written; }
+		};
+
+		// cost of rolling back to a commit, without restoring checkpoints
+		struct ContractRollbackEstimate
+		{
+			uint64_t commits_count = 0;
+			// distinct leveldb keys rewritten or deleted
+			uint64_t keys_count = 0;
+			// approximate bytes of the rewritten keys and values
+			uint64_t bytes = 0;
+		};
+
+		struct ContractRollbackDryRun
+		{
+			ContractCommitId root_state_hash;
+			// root of state tree after rollback, empty when state tree disabled
+			std::string state_root;
+			ContractRollbackEstimate estimate;
+			// leveldb keys the rollback would write or delete
+			std::vector<std::string> changed_keys;
+		};
+
+		struct ContractPruneStats
+		{
+			uint64_t commits_pruned = 0;
+			// size of deleted leveldb keys and values and of deleted commit_info rows
+			uint64_t bytes_reclaimed = 0;
+		};
+
+		struct ContractHistoryVerifyResult
+		{
+			uint64_t commits_count = 0;
+			// commits whose recomputed commit id equals the saved one
+			uint64_t verified_count = 0;
+			// commits whose diff, undo record, former commit or block height is not saved
+			uint64_t unverifiable_count = 0;
+			// commits whose recomputed commit id differs from the saved one or whose diff is corrupted
+			std::vector<ContractCommitId> mismatched_commit_ids;
+
+			bool ok() const { return mismatched_commit_ids.empty(); }
+		};
+
 		class ContractStorageService final
 		{
 		private:
@@ -29,6 +95,39 @@ namespace contract
 			uint32_t _magic_number;
 			std::string _storage_db_path;
 			std::string _storage_sql_db_path;
+			ContractStorageOptions _options;
+			ContractRollbackStats _last_rollback_stats;
+			std::thread _prune_thread;
+			mutable std::mutex _prune_mutex;
+			std::condition_variable _prune_cv;
+			bool _prune_stop = false;
+			ContractPruneStats _prune_stats;
+			// copy of the options read by the pruning thread, set_options may assign _options meanwhile
+			ContractStorageOptions _prune_options;
+			bool _sql_transaction_open = false;
+			// top commit seq when the sql transaction began, commits added after it are removed from the index on rollback
+			uint64_t _sql_transaction_start_seq = 0;
+			// commits were removed from the index by the open sql transaction, a rollback reloads the index
+			bool _sql_transaction_removed_commits = false;
+			// checkpoint dbs whose rows are deleted by the open sql transaction, destroyed after it's committed
+			std::vector<std::string> _pending_checkpoint_removals;
+			// checkpoint due by the open sql transaction, created in background after it's committed
+			std::shared_ptr<ContractCommitInfo> _pending_checkpoint;
+			std::thread _checkpoint_thread;
+			std::atomic<bool> _checkpoint_building { false };
+			// commit id format saved by the first commit, loaded when the db is opened
+			bool _commit_id_format_loaded = false;
+			bool _binary_commit_ids = false;
+			// commit_info in memory, loaded at open and reloaded when a sql transaction is rollbacked
+			ContractCommitIndex _commit_index;
+			// ROOT_STATE_HASH and TOP_ROOT_STATE_HASH as saved in leveldb, updated by every write of them.
+			// commits chain from the saved ids, hex ids are only formatted for the apis
+			std::string _saved_root_state_hash;
+			std::string _saved_top_root_state_hash;
+			std::vector<ContractCommitSubscriptionP> _subscriptions;
+			mutable std::mutex _subscriptions_mutex;
+			// notifications of the current transaction, published after it's committed
+			std::vector<ContractCommitNotificationP> _pending_notifications;
 		public:
 			// suggest use get_instance
 			ContractStorageService(uint32_t magic_number, const std::string& storage_db_path, const std::string& storage_sql_db_path, bool auto_open = true);
@@ -47,12 +146,46 @@ namespace contract
 
 			jsondiff::JsonValue get_contract_storage(AddressType contract_id, const std::string& storage_name) const;
 			std::vector<ContractBalance> get_contract_balances(const AddressType& contract_id) const;
+			// values with proof against current_state_root(), throws when state tree disabled
+			jsondiff::JsonValue get_contract_storage_with_proof(AddressType contract_id, const std::string& storage_name, ContractStateProof& proof) const;
+			std::vector<ContractBalance> get_contract_balances_with_proof(const AddressType& contract_id, ContractStateProof& proof) const;
+			// verify values got with proof by a trusted state root, no db needed
+			static bool verify_contract_storage_proof(const std::string& state_root, const AddressType& contract_id, const std::string& storage_name, const jsondiff::JsonValue& value, const ContractStateProof& proof);
+			static bool verify_contract_balances_proof(const std::string& state_root, const AddressType& contract_id, const std::vector<ContractBalance>& balances, const ContractStateProof& proof);
 			std::shared_ptr<std::vector<ContractEventInfo>> get_commit_events(const ContractCommitId& commit_id) const;
+			// events of all commits of the transaction in commit order
 			std::shared_ptr<std::vector<ContractEventInfo>> get_transaction_events(const std::string& transaction_id) const;
+			// stream the event log by commit seq range(both included) or by index. commits saved before the event log
+			// are not in it, get_commit_events and get_transaction_events still read them
+			ContractEventLogIteratorP iterate_events(uint64_t from_commit_seq = 0, uint64_t to_commit_seq = UINT64_MAX) const;
+			ContractEventLogIteratorP iterate_transaction_events(const std::string& transaction_id) const;
+			ContractEventLogIteratorP iterate_contract_events(const AddressType& contract_id, uint64_t from_commit_seq = 0, uint64_t to_commit_seq = UINT64_MAX) const;
+			ContractEventLogIteratorP iterate_events_by_name(const std::string& event_name, uint64_t from_commit_seq = 0, uint64_t to_commit_seq = UINT64_MAX) const;
+			// stream events matching contract ids, event names and commit seq or block height ranges.
+			// a cursor stopped by filter.limit gives the continuation token of the next query.
+			// a cursor of a block height range reads the commit index, it must not outlive the service
+			ContractEventCursorP query_events(const ContractEventFilter& filter) const;
 
 			// you must ensure changes is right before commit now
 			ContractCommitId commit_contract_changes(ContractChangesP changes);
+			// commit many changes in order, same result as calling commit_contract_changes one by one.
+			// changes not touching keys of former changes in the batch are prepared in parallel. the whole batch is committed or nothing
+			std::vector<ContractCommitId> commit_contract_changes_batch(const std::vector<ContractChangesP>& changes_list);
 			void rollback_contract_state(const ContractCommitId& dest_commit_id);
+			// drop all commits from the first commit with block height above block_height, in one transaction and write batch.
+			// return the commit id rollbacked to, or the current root state hash when no commit is above block_height
+			ContractCommitId rollback_to_block_height(uint32_t block_height);
+			// commits of the block height, oldest first
+			std::vector<ContractCommitInfo> commits_in_block(uint32_t block_height) const;
+			const ContractRollbackStats& last_rollback_stats() const { return _last_rollback_stats; }
+			// notifications of commits and rollbacks are queued to the subscription after each successful transaction.
+			// commits only moving the root state hash to a recorded commit are not notified
+			ContractCommitSubscriptionP subscribe(size_t queue_size = 1024, ContractSubscriberOverflowPolicy policy = SUBSCRIBER_DROP_NOTIFICATION);
+			void unsubscribe(const ContractCommitSubscriptionP& subscription);
+			// estimate cost of rollback_contract_state from undo records of the commits, nothing changed
+			ContractRollbackEstimate estimate_rollback(const ContractCommitId& dest_commit_id) const;
+			// calculate the whole rollback without writing anything
+			ContractRollbackDryRun dry_run_rollback(const ContractCommitId& dest_commit_id) const;
 
 			// don't call this in production usage
 			void clear_sql_db();
@@ -70,13 +203,49 @@ namespace contract
 
 			ContractCommitId top_root_state_hash() const;
 			void reset_root_state_hash(const ContractCommitId& dest_commit_id);
+			// move root state hash forward to a commit after it, undo reset_root_state_hash without recomputing the commits
+			void fast_forward(const ContractCommitId& dest_commit_id);
 
 			ContractCommitId top_commit_id() const;
+			// hex root of state tree over current contract infos and storages, empty when state tree disabled
+			std::string current_state_root() const;
+			// hex multiset hash of all contract infos, storages and name mappings, saved by commits and rollbacks.
+			// nodes with same state have same hash whatever the history. empty before the first commit saving it
+			std::string current_state_set_hash() const;
+			// recompute state set hash by scanning the whole state in parallel
+			std::string compute_state_set_hash() const;
+			// whether saved state set hash matches the state, false means the state is corrupted or the hash is not saved yet
+			bool verify_state_set_hash() const;
+			// recompute every commit id in commit_info from its diff, block height and former commit id.
+			// digests are computed by state_scan_threads threads
+			ContractHistoryVerifyResult verify_history() const;
 			uint32_t magic_number() const { return _magic_number; }
 			uint32_t current_block_height() const { return _current_block_height; }
 			void set_current_block_height(uint32_t block_height) { this->_current_block_height = block_height; }
+			const ContractStorageOptions& options() const { return _options; }
+			// sqlite options are applied to the open connection too
+			void set_options(const ContractStorageOptions& options);
 
 			ContractCommitInfoP get_commit_info(const ContractCommitId& commit_id) const;
+			// commits changing the contract's info, balances or storages with seq >= from_commit_seq, oldest first.
+			// limit 0 means no limit. commits saved before contracts of commits were recorded are not found
+			std::vector<ContractCommitInfo> get_contract_commits(const AddressType& contract_id, uint64_t from_commit_seq = 0, size_t limit = 0) const;
+			// block heights both included
+			ContractCommitsSummary summarize_commits(uint32_t from_block_height, uint32_t to_block_height) const;
+
+			// save checkpoint of current state now, usually they are saved by checkpoint_interval_blocks option
+			void create_checkpoint();
+			std::vector<ContractCheckpointInfo> get_checkpoints() const;
+			// wait for the checkpoint being created in background after a commit
+			void wait_background_checkpoint();
+
+			// commits before commit_id can't be rollbacked to any more, their history is pruned in background batches.
+			// commits are also finalized by keep_last_blocks option
+			void finalize_before(const ContractCommitId& commit_id);
+			ContractCommitId finalized_commit_id() const;
+			// prune at most max_commits finalized commits now, return count of pruned commits
+			size_t prune_history(size_t max_commits);
+			ContractPruneStats prune_stats() const;
 		private:
 			// check db opened? if not, throw boost::exception
 			void check_db() const;
@@ -84,16 +253,89 @@ namespace contract
 			void commit_sql_transaction();
 			void rollback_sql_transaction();
 			void rollback_leveldb_transaction(const leveldb::Snapshot* snapshot_to_rollback, const std::vector<std::string>& changed_keys);
+			// move root state hash to next_commit_id when it's recorded after root_state_hash, return whether moved
+			bool redo_recorded_commit(const ContractCommitId& root_state_hash, const ContractCommitId& next_commit_id, std::vector<std::string>& changed_leveldb_keys);
+			// commits after commit_seq, newest first
+			std::vector<ContractCommitInfo> get_commits_after(uint64_t commit_seq) const;
+			void load_commit_index();
+			// commit_info rows selected by the sql after "from commit_info"
+			std::vector<ContractCommitInfo> query_commit_infos(const std::string& sql_condition) const;
+			// visit the rows one by one from a prepared statement, without collecting them
+			void scan_commit_infos(const std::string& sql_condition, const std::function<void(const ContractCommitInfo&)>& visitor) const;
+			// collect leveldb changes undoing the commit into writes, newer commits must be collected before.
+			// return false when restored from undo record, true when diff replayed without updating state tree
+			bool collect_commit_rollback(const ContractCommitInfo& commit_info, ContractWriteSet& writes) const;
+			uint64_t get_rollback_dest_seq(const ContractCommitId& dest_commit_id) const;
+			bool has_subscribers() const;
+			// push pending notifications to subscriptions, called after the transaction is committed
+			void publish_notifications();
 			void rollback_to_root_state_hash_without_transactional(const ContractCommitId& dest_commit_id, std::vector<std::string>& changed_leveldb_keys);
+			// throws ContractStorageException when a pragma value is not valid
+			static void apply_sqlite_options(sqlite3* sql_db, const ContractSqliteOptions& options);
 			// init commits sql table
 			void init_commits_table();
-			// add commit info to sql db
-			void add_commit_info(ContractCommitId commit_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id);
+			void init_checkpoints_table();
+			uint64_t top_commit_seq() const;
+			// copy the snapshot to a checkpoint db of the commit, recorded only when the commit is not rollbacked
+			void create_checkpoint_of_commit(sqlite3* sql_db, const ContractCommitInfo& commit_info, const leveldb::Snapshot* snapshot, size_t max_checkpoints) const;
+			void create_checkpoint_if_needed(const ContractCommitId& commit_id);
+			void start_background_checkpoint(const ContractCommitInfo& commit_info);
+			// restore the checkpoint between dest commit and top commit when cheaper than rollbacking the commits, return whether restored
+			bool restore_nearest_checkpoint(uint64_t dest_commit_seq, std::vector<std::string>& changed_leveldb_keys);
+			// whether the key is a diff, undo record or event of a commit, which are only deleted by pruning and rollback
+			bool is_commit_history_key(const std::string& key) const;
+			void remove_checkpoints_after(uint64_t commit_seq);
+			// destroy the checkpoint db now, or after the open sql transaction is committed
+			void remove_checkpoint_db(const std::string& path);
+			void init_finalized_table();
+			uint64_t finalized_commit_seq() const;
+			// throw when commit is before the finalized commit
+			void check_not_finalized(uint64_t commit_seq, const ContractCommitId& commit_id) const;
+			void finalize_commit(const ContractCommitInfo& commit_info);
+			void finalize_old_blocks_if_needed();
+			void start_background_pruning();
+			void stop_background_pruning();
+			// sqlite options are copied under _prune_mutex and the commit id format is read when the thread starts
+			void background_pruning_loop(const ContractSqliteOptions& sqlite_options, bool binary_commit_ids);
+			// runs on the pruning thread too, so it reads no service state the committing thread writes
+			size_t prune_history_batch(sqlite3* sql_db, size_t max_commits, bool prune_events, bool binary_commit_ids);
+			// add commit info to sql db, return its seq
+			uint64_t add_commit_info(ContractWriteSet& writes, const ContractCommitId& commit_id, const std::string& saved_id, const std::string &change_type, const std::string &diff_str, const std::string &contract_id);
+			// update state tree by pending changes of contract infos and storages, build or drop it by state_tree option
+			void update_state_tree(ContractWriteSet& writes) const;
+			void build_state_tree(ContractWriteSet& writes) const;
+			// update saved state set hash by pending changes, compute it by a full scan when not saved before
+			void update_state_set_hash(ContractWriteSet& writes) const;
+			ContractStateSetHash scan_state_set_hash(const leveldb::Snapshot* snapshot) const;
+			// write pending changes to leveldb in one batch
+			void write_changes(const ContractWriteSet& writes, std::vector<std::string>& changed_leveldb_keys);
+			// read cached root state hashes from leveldb
+			void load_root_state_hashes();
+			void load_commit_id_format();
+			// calculate leveldb changes of contract changes without writing them
+			void prepare_contract_changes(PreparedContractChanges& prepared) const;
+			void prepare_contract_changes_parallel(std::vector<PreparedContractChanges>& prepared_list, const std::vector<size_t>& indexes) const;
+			// save bloom of the commit's events, and the aggregated bloom of the block range the commits left
+			void add_event_blooms(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events) const;
+			// commit prepared changes after current root state hash, return the new commit id
+			ContractCommitId apply_prepared_contract_changes(PreparedContractChanges& prepared, std::vector<std::string>& changed_leveldb_keys);
 			// get value from key-value db by key
 			std::string get_value_by_key_or_error(const std::string &key);
 			jsondiff::JsonValue get_json_value_by_key_or_null(const std::string &key);
 
-			ContractCommitId generate_next_root_hash(const std::string& old_root_state_hash, const fcrypto::sha256& diff_hash) const;
+			fcrypto::sha256 generate_next_root_hash(const std::string& saved_old_root_state_hash, const fcrypto::sha256& diff_hash) const;
+			fcrypto::sha256 chain_commit_id(const std::string& saved_old_root_state_hash, const fcrypto::sha256& diff_hash, uint32_t block_height) const;
+			// digest chained into the commit id, false when the diff or undo record needed is not saved
+			bool recompute_commit_digest(const ContractCommitInfo& commit_info, const leveldb::Snapshot* snapshot, fcrypto::sha256& digest) const;
+			// commit ids are hex out of the service. dbs using binary commit ids save them as 32 raw bytes
+			// in leveldb keys and values and as blobs in commit_info
+			bool uses_binary_commit_ids() const;
+			std::string saved_commit_id(const ContractCommitId& commit_id) const;
+			std::string saved_commit_id(const fcrypto::sha256& commit_id) const;
+			ContractCommitId commit_id_from_saved(const std::string& saved) const;
+			// sql literal of commit id in commit_info, and the column expression reading it as hex
+			std::string commit_id_sql_value(const ContractCommitId& commit_id) const;
+			std::string commit_id_sql_column() const;
 
 			// calculate new-contract-info commit
 			fcrypto::sha256 hash_new_contract_info_commit(ContractInfoP contract_info) const;
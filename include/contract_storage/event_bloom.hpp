@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <contract_storage/change.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		// bloom filter over contract ids, event names and (contract id, event name) pairs of events.
+		// bit positions of an item come from sha256 of it, so blooms are the same on every node
+		class ContractEventBloom
+		{
+		public:
+			static const std::string commit_key_prefix;
+			static const std::string range_key_prefix;
+			// block range being filled and its first commit seq
+			static const std::string open_range_key;
+
+			ContractEventBloom();
+			// sized for events_count events
+			explicit ContractEventBloom(size_t events_count);
+			// throws ContractStorageException when bytes are not a bloom
+			static ContractEventBloom from_bytes(const std::string& bytes);
+			const std::string& bytes() const { return _bits; }
+
+			void add_event(const ContractEventInfo& event);
+			bool may_contain_contract(const AddressType& contract_id) const;
+			bool may_contain_event_name(const std::string& event_name) const;
+			bool may_contain(const AddressType& contract_id, const std::string& event_name) const;
+
+			static std::string make_commit_key(uint64_t commit_seq);
+			static std::string make_range_key(uint32_t range_index);
+		private:
+			std::string _bits;
+
+			void add_item(const std::string& item);
+			bool may_contain_item(const std::string& item) const;
+		};
+
+		// aggregated bloom of the events of commits from first_commit_seq to last_commit_seq, all in one block range
+		struct ContractEventRangeBloom
+		{
+			uint64_t first_commit_seq = 0;
+			uint64_t last_commit_seq = 0;
+			ContractEventBloom bloom;
+
+			std::string encode() const;
+			static ContractEventRangeBloom decode(const std::string& data);
+		};
+	}
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <contract_storage/change.hpp>
+#include <contract_storage/write_set.hpp>
+#include <contract_storage/event_bloom.hpp>
+#include <leveldb/db.h>
+
+namespace contract
+{
+	namespace storage
+	{
+		struct ContractEventLogEntry
+		{
+			// id of the commit in commit_info
+			uint64_t commit_seq = 0;
+			// index of the event in the commit's events
+			uint32_t event_index = 0;
+			ContractEventInfo event;
+		};
+
+		// append-only log of events keyed by (commit seq, index in commit), with index keys by transaction id,
+		// contract id and event name ending with the entry's position and holding no value. entries are put
+		// in the commit's write set, so its undo record removes exactly them on rollback
+		class ContractEventLog
+		{
+		public:
+			static const std::string entry_key_prefix;
+			static const std::string transaction_index_prefix;
+			static const std::string contract_index_prefix;
+			static const std::string name_index_prefix;
+
+			// put log entries and index keys of the events of a commit
+			static void append(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events);
+			// remove what append put, events must be the same
+			static void remove(ContractWriteSet& writes, uint64_t commit_seq, const std::vector<ContractEventInfo>& events);
+			// log entries and index keys of a commit found in db
+			static std::vector<std::string> commit_keys(leveldb::DB* db, const leveldb::ReadOptions& read_options, uint64_t commit_seq);
+
+			// fixed width, so keys sort by commit seq then by event index
+			static std::string make_position(uint64_t commit_seq, uint32_t event_index);
+			static bool parse_position(const std::string& position, uint64_t* commit_seq, uint32_t* event_index);
+			static std::string make_entry_key(uint64_t commit_seq, uint32_t event_index);
+			// prefix of index keys of one value, the position follows it
+			static std::string make_index_prefix(const std::string& index_prefix, const std::string& value);
+
+			static std::string encode_event(const ContractEventInfo& event);
+			// throws ContractStorageException when data is not a valid log entry
+			static ContractEventInfo decode_event(const std::string& data);
+		};
+
+		// streams entries of the event log, or of one index of it, in log order from from_position to the end of to_commit_seq.
+		// entries are read one at a time on the snapshot, or on a snapshot taken when created
+		class ContractEventLogIterator
+		{
+		private:
+			leveldb::DB* _db;
+			const leveldb::Snapshot* _snapshot;
+			bool _owns_snapshot;
+			leveldb::ReadOptions _read_options;
+			std::unique_ptr<leveldb::Iterator> _it;
+			// keys of the log or of the index value
+			std::string _prefix;
+			bool _is_index;
+			std::string _end_position;
+			bool _valid = false;
+			ContractEventLogEntry _entry;
+
+			void load();
+		public:
+			// empty index_prefix and value iterate the log itself
+			ContractEventLogIterator(leveldb::DB* db, const leveldb::Snapshot* snapshot, const std::string& index_prefix, const std::string& value,
+				const std::string& from_position, uint64_t to_commit_seq);
+			~ContractEventLogIterator();
+
+			bool valid() const { return _valid; }
+			void next();
+			// move to the first entry at or after position
+			void seek(const std::string& from_position);
+			const ContractEventLogEntry& entry() const { return _entry; }
+		};
+		typedef std::unique_ptr<ContractEventLogIterator> ContractEventLogIteratorP;
+
+		struct ContractEventFilter
+		{
+			// empty sets match all contracts or names
+			std::set<AddressType> contract_ids;
+			std::set<std::string> event_names;
+			// both included
+			uint64_t from_commit_seq = 0;
+			uint64_t to_commit_seq = UINT64_MAX;
+			// both included, commits of the heights must not be pruned
+			uint32_t from_block_height = 0;
+			uint32_t to_block_height = UINT32_MAX;
+			// max events of the cursor, 0 means no limit
+			size_t limit = 0;
+			// token of a former cursor stopped by limit, the query continues from there
+			std::string continuation;
+		};
+
+		// streams events matching a filter in log order. matches are read from the index of contract ids,
+		// or of event names, or from the log itself, all iterators on one snapshot.
+		// filtering both contract ids and event names skips block ranges and commits whose event blooms have no matching pair
+		class ContractEventCursor
+		{
+		private:
+			leveldb::DB* _db;
+			const leveldb::Snapshot* _snapshot;
+			leveldb::ReadOptions _read_options;
+			std::vector<ContractEventLogIteratorP> _iterators;
+			// contract id of each iterator when reading the contract ids index
+			std::vector<AddressType> _iterator_contract_ids;
+			// commit whose bloom each iterator checked last
+			std::vector<uint64_t> _checked_commit_seqs;
+			// range blooms overlapping the query in commit seq order
+			std::vector<ContractEventRangeBloom> _range_blooms;
+			std::set<std::string> _event_names;
+			// false for commits in the seq range whose events don't match the filter's block heights
+			std::function<bool(uint64_t)> _commit_seq_matches;
+			size_t _limit;
+			size_t _count = 0;
+			ContractEventLogIterator* _current = nullptr;
+			std::string _continuation;
+
+			// move _current to the earliest matching entry of all iterators
+			void find_match();
+			bool bloom_matches(const ContractEventBloom& bloom, const AddressType& contract_id) const;
+			// seek iterator past block ranges and commits without events of its contract and the filter's names
+			void skip_unmatched(size_t index);
+		public:
+			// events of commit seqs from the filter which commit_seq_matches accepts, when it's set.
+			// the block height range is resolved by the caller
+			ContractEventCursor(leveldb::DB* db, const ContractEventFilter& filter, uint64_t from_commit_seq, uint64_t to_commit_seq,
+				std::function<bool(uint64_t)> commit_seq_matches = nullptr);
+			~ContractEventCursor();
+
+			bool valid() const { return _current != nullptr; }
+			void next();
+			const ContractEventLogEntry& entry() const { return _current->entry(); }
+			// token of the first match after the limit, empty when all matches are read
+			const std::string& continuation() const { return _continuation; }
+		};
+		typedef std::unique_ptr<ContractEventCursor> ContractEventCursorP;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+namespace contract
+{
+	namespace storage
+	{
+		// multiset hash of key-value pairs: sum of sha256(key size + key + value) mod 2^256.
+		// adding and removing pairs in any order gives the same hash, so it's updated by changed keys only
+		class ContractStateSetHash
+		{
+		private:
+			// little endian 64 bits limbs
+			uint64_t _limbs[4];
+
+			void add_limbs(const uint64_t* limbs);
+			void sub_limbs(const uint64_t* limbs);
+		public:
+			ContractStateSetHash();
+			// from 32 bytes big endian value, throws ContractStorageException when size wrong
+			static ContractStateSetHash from_bytes(const std::string& bytes);
+
+			void add(const std::string& key, const std::string& value);
+			void remove(const std::string& key, const std::string& value);
+			void merge(const ContractStateSetHash& other);
+
+			// 32 bytes big endian
+			std::string bytes() const;
+			std::string str() const;
+
+			bool operator==(const ContractStateSetHash& other) const;
+			bool operator!=(const ContractStateSetHash& other) const { return !(*this == other); }
+		};
+	}
+}
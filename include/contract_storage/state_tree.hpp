@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <contract_storage/write_set.hpp>
+#include <fcrypto/sha256.hpp>
+#include <jsondiff/jsondiff.h>
+
+namespace contract
+{
+	namespace storage
+	{
+		// proof of a key's value, or of the key not existing, in a state tree
+		struct ContractStateProof
+		{
+			std::string key;
+			bool exists = false;
+			std::string value; // value of key when exists
+			// leaf of another key where the path of key ends, when key not exists
+			bool has_other_leaf = false;
+			fcrypto::sha256 other_leaf_path;
+			fcrypto::sha256 other_leaf_value_hash;
+			// sibling hashes from root down to the leaf
+			std::vector<fcrypto::sha256> siblings;
+			// hex root the proof is made against
+			std::string state_root;
+
+			jsondiff::JsonObject to_json() const;
+			static ContractStateProof from_json(const jsondiff::JsonObject& json_obj);
+		};
+
+		// sparse merkle tree from sha256 of leveldb keys to sha256 of their values, nodes are saved in the write set.
+		// a subtree with only one leaf is saved as the leaf, so an update reads and writes about log2(leaves count) nodes
+		// and the root only depends on the leaves.
+		// empty subtree hash is zero, leaf hash = sha256(0x00 + path + value hash), inner hash = sha256(0x01 + left + right)
+		class ContractStateTree
+		{
+		public:
+			static const std::string node_key_prefix;
+			static const size_t path_bits = 256;
+
+			explicit ContractStateTree(ContractWriteSet& writes);
+
+			// set leaf of key to hash of value
+			void put(const std::string& key, const std::string& value);
+			void remove(const std::string& key);
+			// zero hash when tree is empty
+			fcrypto::sha256 root() const;
+			ContractStateProof prove(const std::string& key) const;
+
+			// check proof by hashes only, proof.state_root is not trusted
+			static bool verify(const ContractStateProof& proof, const fcrypto::sha256& root);
+
+			static fcrypto::sha256 key_path(const std::string& key);
+			static fcrypto::sha256 leaf_hash(const fcrypto::sha256& path, const fcrypto::sha256& value_hash);
+			static fcrypto::sha256 inner_hash(const fcrypto::sha256& left, const fcrypto::sha256& right);
+			static bool path_bit(const fcrypto::sha256& path, size_t index);
+		private:
+			enum NodeType
+			{
+				EMPTY_NODE = 0,
+				LEAF_NODE = 'l',
+				INNER_NODE = 'n'
+			};
+			struct Node
+			{
+				NodeType type = EMPTY_NODE;
+				// path and value hash of leaf, or children hashes of inner node
+				fcrypto::sha256 first;
+				fcrypto::sha256 second;
+
+				fcrypto::sha256 hash() const;
+			};
+
+			ContractWriteSet& _writes;
+
+			static std::string make_node_key(size_t depth, const fcrypto::sha256& path);
+			Node read_node(size_t depth, const fcrypto::sha256& path) const;
+			void write_node(size_t depth, const fcrypto::sha256& path, const Node& node);
+			// update subtree at depth containing path, return its new top node
+			Node update(size_t depth, const fcrypto::sha256& path, const fcrypto::sha256& value_hash, bool is_remove);
+			// replace leaf at depth by inner nodes down to where it and the new leaf split
+			Node split(size_t depth, const Node& old_leaf, const Node& new_leaf);
+		};
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <contract_storage/commit.hpp>
+#include <contract_storage/change.hpp>
+
+namespace contract
+{
+	namespace storage
+	{
+		struct ContractCommitNotification
+		{
+			bool is_rollback = false;
+			// root state hash after the commit or rollback
+			ContractCommitId commit_id;
+			// seq of the commit in commit_info. after a rollback the seq of the dest commit, newer commits are removed
+			uint64_t commit_seq = 0;
+			uint32_t block_height = 0;
+			// changed keys of contract infos, storages and name mappings
+			std::vector<std::string> changed_keys;
+			// contracts whose info, balances or storages changed
+			std::set<AddressType> changed_contracts;
+			// events of the commit, empty for rollback
+			std::vector<ContractEventInfo> events;
+		};
+		typedef std::shared_ptr<const ContractCommitNotification> ContractCommitNotificationP;
+
+		// what a commit does when a subscriber's queue is full
+		enum ContractSubscriberOverflowPolicy
+		{
+			// drop the notification and count it, the subscriber must rescan to catch up
+			SUBSCRIBER_DROP_NOTIFICATION = 0,
+			// close the subscription, no more notifications are queued
+			SUBSCRIBER_CLOSE = 1,
+			// the commit waits until the subscriber pops or closes, never pop from the committing thread then
+			SUBSCRIBER_BLOCK_COMMIT = 2
+		};
+
+		// bounded single producer single consumer queue of notifications. the committing thread pushes
+		// and one consumer thread pops, neither takes a lock but a push blocked by SUBSCRIBER_BLOCK_COMMIT
+		class ContractCommitSubscription
+		{
+		private:
+			std::vector<ContractCommitNotificationP> _slots;
+			ContractSubscriberOverflowPolicy _policy;
+			// counts of popped and pushed notifications, slot is count % capacity
+			std::atomic<uint64_t> _head;
+			std::atomic<uint64_t> _tail;
+			std::atomic<uint64_t> _dropped_count;
+			std::atomic<bool> _closed;
+			// a push blocked by SUBSCRIBER_BLOCK_COMMIT waits for a pop or close here
+			std::mutex _wait_mutex;
+			std::condition_variable _wait_condition;
+			std::atomic<bool> _push_waiting;
+
+			void wake_push();
+		public:
+			ContractCommitSubscription(size_t capacity, ContractSubscriberOverflowPolicy policy);
+
+			// called by the committing thread only
+			void push(const ContractCommitNotificationP& notification);
+			// consumer side, return false when the queue is empty
+			bool try_pop(ContractCommitNotificationP& notification);
+
+			size_t capacity() const { return _slots.size(); }
+			ContractSubscriberOverflowPolicy policy() const { return _policy; }
+			// notifications dropped by SUBSCRIBER_DROP_NOTIFICATION
+			uint64_t dropped_count() const { return _dropped_count.load(); }
+			// closed by unsubscribe or by SUBSCRIBER_CLOSE on overflow, queued notifications can still be popped
+			bool closed() const { return _closed.load(); }
+			void close();
+		};
+		typedef std::shared_ptr<ContractCommitSubscription> ContractCommitSubscriptionP;
+	}
+}
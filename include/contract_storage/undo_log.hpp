@@ -0,0 +1,21 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace contract
+{
+	namespace storage
+	{
+		// value of a leveldb key before a commit changed it. rollback restores it without replaying the commit's diff
+		struct ContractUndoItem
+		{
+			std::string key;
+			bool existed = false; // false when the key is created by the commit, so rollback deletes it
+			std::string value;
+		};
+
+		std::string encode_undo_items(const std::vector<ContractUndoItem>& items);
+		// throws ContractStorageException when data is not a valid undo record
+		std::vector<ContractUndoItem> decode_undo_items(const std::string& data);
+	}
+}
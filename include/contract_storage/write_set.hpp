@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+namespace contract
+{
+	namespace storage
+	{
+		struct ContractWriteSetItem
+		{
+			bool deleted = false;
+			std::string value;
+			// value before the first change in this write set
+			bool existed = false;
+			std::string old_value;
+		};
+
+		// pending leveldb changes of one commit. reads see the pending changes first, then the db(or the snapshot when set)
+		class ContractWriteSet
+		{
+		private:
+			leveldb::DB *_db;
+			const leveldb::Snapshot* _snapshot;
+			std::map<std::string, ContractWriteSetItem> _items;
+			size_t _write_count = 0;
+
+			ContractWriteSetItem& touch(const std::string& key);
+		public:
+			ContractWriteSet(leveldb::DB* db, const leveldb::Snapshot* snapshot = nullptr);
+
+			// read value of key, return false when key not found
+			bool get(const std::string& key, std::string* value) const;
+			void put(const std::string& key, const std::string& value);
+			void remove(const std::string& key);
+
+			void set_snapshot(const leveldb::Snapshot* snapshot) { _snapshot = snapshot; }
+			bool empty() const { return _items.empty(); }
+			void clear() { _items.clear(); _write_count = 0; }
+			// count of put and remove calls, a key changed many times counts many times
+			size_t write_count() const { return _write_count; }
+			const std::map<std::string, ContractWriteSetItem>& items() const { return _items; }
+			std::vector<std::string> changed_keys() const;
+
+			void write_to(leveldb::WriteBatch* batch) const;
+		};
+	}
+}
@@ -1,8 +1,33 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 
 /* Common stuff for cryptographic hashes
  */
 namespace fcrypto { namespace detail {
     void shift_l( const char* in, char* out, std::size_t n, unsigned int i);
     void shift_r( const char* in, char* out, std::size_t n, unsigned int i);
+
+    extern const uint32_t sha256_k[64];
+
+    /* sha1 and sha2-256 message state, blocks are compressed by current sha backend
+     */
+    template<std::size_t Words>
+    struct sha_ctx {
+        uint32_t      h[Words];
+        unsigned char buffer[64];
+        uint64_t      length;
+    };
+    typedef sha_ctx<5> sha1_ctx;
+    typedef sha_ctx<8> sha256_ctx;
+
+    void sha1_init( sha1_ctx& ctx );
+    void sha1_update( sha1_ctx& ctx, const char* d, std::size_t dlen );
+    void sha1_final( sha1_ctx& ctx, char* out );
+
+    void sha256_init( sha256_ctx& ctx );
+    void sha224_init( sha256_ctx& ctx );
+    void sha256_update( sha256_ctx& ctx, const char* d, std::size_t dlen );
+    // out_size is 32 for sha256 and 28 for sha224
+    void sha256_final( sha256_ctx& ctx, char* out, std::size_t out_size );
 }}
@@ -3,6 +3,7 @@
 #include <fjson/string.hpp>
 #include <fcrypto/platform_independence.hpp>
 #include <fjson/io/raw_fwd.hpp>
+#include <vector>
 
 namespace fcrypto
 {
@@ -25,6 +26,11 @@ class sha256
     static sha256 hash( const string& );
     static sha256 hash( const sha256& );
 
+    // hash independent messages, results[i] equals hash( datas[i], sizes[i] ).
+    // uses 8 lanes simd when the cpu supports avx2 but not sha extensions, see set_sha256_many_backend
+    static void hash_many( const char* const* datas, const uint32_t* sizes, size_t count, sha256* results );
+    static std::vector<sha256> hash_many( const std::vector<string>& messages );
+
     template<typename T>
     static sha256 hash( const T& t ) 
     { 
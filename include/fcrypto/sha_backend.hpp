@@ -0,0 +1,30 @@
+#pragma once
+
+namespace fcrypto {
+
+  // block functions used by sha1, sha224 and sha256 encoders
+  enum class sha_backend {
+    openssl, // openssl's block functions, works on every cpu
+    sha_ni   // x86 sha extensions
+  };
+
+  // sha_ni when the cpu supports it, otherwise openssl
+  sha_backend current_sha_backend();
+  // return false and keep current backend when the cpu doesn't support it
+  bool set_sha_backend( sha_backend backend );
+  bool sha_backend_supported( sha_backend backend );
+  const char* sha_backend_name( sha_backend backend );
+
+  // how sha256::hash_many hashes its messages
+  enum class sha256_many_backend {
+    automatic, // avx2 lanes for 4 or more messages when the cpu supports avx2 but not sha extensions
+    single,    // one message at a time with the sha backend
+    avx2       // 8 avx2 lanes whatever the count and the sha backend
+  };
+
+  sha256_many_backend current_sha256_many_backend();
+  // return false and keep current backend when the cpu doesn't support it
+  bool set_sha256_many_backend( sha256_many_backend backend );
+  bool sha256_many_backend_supported( sha256_many_backend backend );
+
+} // fcrypto
@@ -1,8 +1,11 @@
 #include <contract_storage/contract_storage.hpp>
+#include <contract_storage/exceptions.hpp>
 #include <thread>
 #include <chrono>
 #include <iostream>
 #include <fcrypto/base58.hpp>
+#include <fcrypto/sha256.hpp>
+#include <fcrypto/sha_backend.hpp>
 
 using namespace contract::storage;
 using namespace jsondiff;
@@ -38,6 +41,7 @@ int main(int argc, char **argv)
 	contract_info->apis.push_back("say");
 	contract_info->offline_apis.push_back("query1");
 	contract_info->offline_apis.push_back("name");
+	const auto first_contract_info = std::make_shared<ContractInfo>(*contract_info);
 	auto commit1 = service->save_contract_info(contract_info);
 	auto contract_info_found = service->get_contract_info(contract_info->id);
 
@@ -76,7 +80,15 @@ int main(int argc, char **argv)
 	changes1->events.push_back(ContractEventInfo{"tx1", "contract1", "hello", "world123"});
 
 	auto commit_id_before_commit2 = commit1_after_change_contract_desc;
+	auto subscription = service->subscribe(16);
 	auto commit2 = service->commit_contract_changes(changes1);
+	ContractCommitNotificationP notification;
+	assert(subscription->try_pop(notification) && !notification->is_rollback && notification->commit_id == commit2);
+	assert(notification->events.size() == 1 && notification->changed_contracts.count(contract_info->id) == 1);
+	auto commit2_info = service->get_commit_info(commit2);
+	assert(commit2_info->keys_written >= 2 && commit2_info->diff_size > 0);
+	const auto& contract_commits = service->get_contract_commits(contract_info->id);
+	assert(!contract_commits.empty() && contract_commits.back().commit_id == commit2);
 
 
 
@@ -92,9 +104,26 @@ int main(int argc, char **argv)
 	auto transaction_events_after_commit_changes1 = service->get_transaction_events(changes1->events[0].transaction_id);
 	assert(commit_events_after_commit_changes1->size() == 1);
 	assert(transaction_events_after_commit_changes1->size() == 1);
+	auto contract_events_it = service->iterate_contract_events("contract1");
+	assert(contract_events_it->valid() && contract_events_it->entry().event.event_name == "hello");
+	contract_events_it->next();
+	assert(!contract_events_it->valid());
+	contract_events_it.reset();
+	ContractEventFilter event_filter;
+	event_filter.contract_ids.insert("contract1");
+	event_filter.event_names.insert("hello");
+	event_filter.limit = 1;
+	auto event_cursor = service->query_events(event_filter);
+	assert(event_cursor->valid() && event_cursor->entry().event.event_arg == "world123");
+	event_cursor->next();
+	assert(!event_cursor->valid() && event_cursor->continuation().empty());
+	event_cursor.reset();
 
 	// rollback
 	service->rollback_contract_state(commit_id_before_commit2);
+	assert(subscription->try_pop(notification) && notification->is_rollback && notification->commit_id == commit_id_before_commit2);
+	assert(!subscription->try_pop(notification));
+	service->unsubscribe(subscription);
 
 	assert(!service->is_current_root_state_hash_after(commit2));
 
@@ -108,6 +137,74 @@ int main(int argc, char **argv)
 	// TODO: test get snapshot after current commit id
 	auto commit2_again_again = service->commit_contract_changes(changes1);
 	assert(commit2_again_again == commit2);
+	assert(service->is_latest());
+
+	// fast forward moves the reset root state hash back to a recorded commit without recomputing it
+	service->reset_root_state_hash(commit_id_before_commit2);
+	assert(!service->is_latest());
+	service->fast_forward(commit2);
+	assert(service->is_latest() && service->current_root_state_hash() == commit2);
+	assert(service->get_contract_storage(contract_info->id, "name").as_string() == "China");
+	assert(service->get_contract_balances(contract_info->id)[0].amount == 100);
+	bool fast_forward_backward_failed = false;
+	try
+	{
+		service->fast_forward(commit1);
+	}
+	catch (const ContractStorageException&)
+	{
+		fast_forward_backward_failed = true;
+	}
+	assert(fast_forward_backward_failed && service->current_root_state_hash() == commit2);
+
+	// batch commit gives same commits as committing one by one
+	{
+		auto changes_storage = std::make_shared<ContractChanges>();
+		ContractStorageChange storage_change;
+		storage_change.contract_id = contract_info->id;
+		ContractStorageItemChange item_change;
+		item_change.name = "country";
+		item_change.diff = make_json_diff_of_string(differ, "", "Japan");
+		storage_change.items.push_back(item_change);
+		changes_storage->storage_changes.push_back(storage_change);
+		auto changes_balance = std::make_shared<ContractChanges>();
+		changes_balance->balance_changes.push_back(balance_change1);
+		std::vector<ContractChangesP> batch{ changes_storage, changes_balance, changes_balance };
+
+		// state tree is built by the first commit after enabled
+		auto tree_options = service->options();
+		tree_options.state_tree = true;
+		service->set_options(tree_options);
+		std::vector<ContractCommitId> commit_ids_one_by_one;
+		for (const auto& changes : batch)
+			commit_ids_one_by_one.push_back(service->commit_contract_changes(changes));
+		const auto state_root_one_by_one = service->current_state_root();
+		assert(!state_root_one_by_one.empty());
+		assert(service->get_commit_info(commit_ids_one_by_one.back())->state_root == state_root_one_by_one);
+		const auto state_set_hash_one_by_one = service->current_state_set_hash();
+		auto rollback_dry_run = service->dry_run_rollback(commit2);
+		assert(rollback_dry_run.estimate.commits_count == 3);
+		assert(service->estimate_rollback(commit2).keys_count == rollback_dry_run.estimate.keys_count);
+		assert(service->current_root_state_hash() == commit_ids_one_by_one.back());
+		service->rollback_contract_state(commit2);
+		auto commit_ids_of_batch = service->commit_contract_changes_batch(batch);
+		assert(commit_ids_of_batch == commit_ids_one_by_one);
+		assert(service->current_state_root() == state_root_one_by_one);
+		assert(service->current_state_set_hash() == state_set_hash_one_by_one);
+		assert(service->verify_state_set_hash());
+		const auto& history_verify_result = service->verify_history();
+		assert(history_verify_result.ok() && history_verify_result.verified_count == history_verify_result.commits_count);
+		ContractStateProof storage_proof;
+		const auto& proved_country = service->get_contract_storage_with_proof(contract_info->id, "country", storage_proof);
+		assert(ContractStorageService::verify_contract_storage_proof(state_root_one_by_one, contract_info->id, "country", proved_country, storage_proof));
+		ContractStateProof balances_proof;
+		const auto& proved_balances = service->get_contract_balances_with_proof(contract_info->id, balances_proof);
+		assert(ContractStorageService::verify_contract_balances_proof(state_root_one_by_one, contract_info->id, proved_balances, balances_proof));
+		tree_options.state_tree = false;
+		service->set_options(tree_options);
+		assert(service->get_contract_balances(contract_info->id)[0].amount == 300);
+		assert(service->get_contract_storage(contract_info->id, "country").as_string() == "Japan");
+	}
 
 	service->rollback_contract_state(commit1);
 	auto cur_root_hash = service->current_root_state_hash();
@@ -125,6 +222,7 @@ int main(int argc, char **argv)
 	auto transaction_events_after_rollback = service->get_transaction_events(changes1->events[0].transaction_id);
 	assert(commit_events_after_rollback->size() == 0);
 	assert(transaction_events_after_rollback->size() == 0);
+	assert(!service->iterate_events_by_name("hello")->valid());
 
 	// rollback to contract not created
 	service->rollback_contract_state(EMPTY_COMMIT_ID);
@@ -137,6 +235,437 @@ int main(int argc, char **argv)
 	auto name_storage_after_rollback2 = service->get_contract_storage(contract_info->id, "name").as_string();
 	assert(name_storage_after_rollback2 == "");
 
+	// drop a block by its height
+	service->set_current_block_height(5);
+	service->save_contract_info(contract_info);
+	assert(service->commits_in_block(5).size() == 1);
+	assert(service->rollback_to_block_height(4) == EMPTY_COMMIT_ID);
+	assert(service->commits_in_block(5).empty() && !service->get_contract_info(contract_info->id));
+
+	// changes renaming the "name" storage of the contract
+	auto make_name_changes = [&](const std::string& old_name, const std::string& new_name) {
+		auto changes = std::make_shared<ContractChanges>();
+		ContractStorageChange storage_change;
+		storage_change.contract_id = contract_info->id;
+		ContractStorageItemChange item_change;
+		item_change.name = "name";
+		item_change.diff = make_json_diff_of_string(differ, old_name, new_name);
+		storage_change.items.push_back(item_change);
+		changes->storage_changes.push_back(storage_change);
+		return changes;
+	};
+
+	// a checkpoint replaces rollbacking the commits after it
+	{
+		ContractStorageService checkpoint_service(magic_num, "test_checkpoint_leveldb.db", "test_checkpoint_sql_db.db");
+		auto checkpoint_options = checkpoint_service.options();
+		checkpoint_options.checkpoint_interval_blocks = 10;
+		checkpoint_options.rollback_keys_per_commit = 1000;
+		checkpoint_options.prune_events = true;
+		checkpoint_options.background_pruning = false;
+		checkpoint_service.set_options(checkpoint_options);
+		checkpoint_service.set_current_block_height(10);
+		auto checkpoint_base = checkpoint_service.save_contract_info(contract_info);
+		// checkpoints are created in background after the commit
+		checkpoint_service.wait_background_checkpoint();
+		assert(checkpoint_service.get_checkpoints().size() == 1 && checkpoint_service.get_checkpoints()[0].commit_id == checkpoint_base);
+		checkpoint_service.set_current_block_height(11);
+		auto changes_with_event = make_name_changes("", "n11");
+		changes_with_event->events.push_back(ContractEventInfo{ "tx-checkpoint", contract_info->id, "renamed", "n11" });
+		checkpoint_service.commit_contract_changes(changes_with_event);
+		checkpoint_service.set_current_block_height(12);
+		auto commit_at_12 = checkpoint_service.commit_contract_changes(make_name_changes("n11", "n12"));
+		checkpoint_service.set_current_block_height(13);
+		checkpoint_service.commit_contract_changes(make_name_changes("n12", "n13"));
+		checkpoint_service.set_current_block_height(20);
+		auto commit_at_20 = checkpoint_service.commit_contract_changes(make_name_changes("n13", "n20"));
+		checkpoint_service.wait_background_checkpoint();
+		assert(checkpoint_service.get_checkpoints().size() == 2 && checkpoint_service.get_checkpoints()[1].commit_id == commit_at_20);
+		checkpoint_service.set_current_block_height(21);
+		checkpoint_service.commit_contract_changes(make_name_changes("n20", "n21"));
+
+		// history pruned after the checkpoint was taken isn't restored
+		checkpoint_service.finalize_before(commit_at_12);
+		assert(checkpoint_service.prune_history(100) == 2);
+		assert(checkpoint_service.get_transaction_events("tx-checkpoint")->empty());
+		assert(checkpoint_service.get_checkpoints().size() == 1 && checkpoint_service.get_checkpoints()[0].commit_id == commit_at_20);
+
+		// only the 2 commits between the dest and the checkpoint are rollbacked one by one
+		checkpoint_service.rollback_contract_state(commit_at_12);
+		assert(checkpoint_service.last_rollback_stats().commits_count == 2);
+		assert(checkpoint_service.current_root_state_hash() == commit_at_12 && checkpoint_service.top_root_state_hash() == commit_at_12);
+		assert(checkpoint_service.get_contract_storage(contract_info->id, "name").as_string() == "n12");
+		assert(checkpoint_service.get_transaction_events("tx-checkpoint")->empty());
+		assert(checkpoint_service.verify_history().ok());
+		// checkpoints after the dest are removed with the commits
+		assert(checkpoint_service.get_checkpoints().empty());
+	}
+
+	// binary commit ids chain from raw bytes, the default hex chain is unchanged
+	{
+		ContractStorageService hex_service(magic_num, "test_hex_ids_leveldb.db", "test_hex_ids_sql_db.db");
+		assert(hex_service.save_contract_info(first_contract_info) == commit1);
+
+		ContractStorageService binary_service(magic_num, "test_binary_ids_leveldb.db", "test_binary_ids_sql_db.db");
+		auto binary_options = binary_service.options();
+		binary_options.binary_commit_ids = true;
+		binary_service.set_options(binary_options);
+		auto binary_commit1 = binary_service.save_contract_info(first_contract_info);
+		assert(binary_commit1.size() == commit1.size() && binary_commit1 != commit1);
+		binary_service.set_current_block_height(1);
+		auto binary_commit2 = binary_service.commit_contract_changes(make_name_changes("", "b1"));
+		binary_service.set_current_block_height(2);
+		auto binary_commit3 = binary_service.commit_contract_changes(make_name_changes("b1", "b2"));
+		assert(binary_service.get_commit_info(binary_commit2)->commit_id == binary_commit2);
+		assert(binary_service.current_root_state_hash() == binary_commit3);
+
+		binary_service.rollback_contract_state(binary_commit2);
+		assert(binary_service.current_root_state_hash() == binary_commit2 && binary_service.top_root_state_hash() == binary_commit2);
+		assert(binary_service.get_contract_storage(contract_info->id, "name").as_string() == "b1");
+
+		// the format is kept by the db after reopened, whatever the option
+		binary_service.close();
+		binary_service.set_options(ContractStorageOptions());
+		binary_service.open();
+		assert(binary_service.current_root_state_hash() == binary_commit2 && binary_service.get_commit_info(binary_commit1));
+		assert(binary_service.commit_contract_changes(make_name_changes("b1", "b2")) == binary_commit3);
+		const auto& binary_verify_result = binary_service.verify_history();
+		assert(binary_verify_result.ok() && binary_verify_result.commits_count == 3 && binary_verify_result.verified_count == 3);
+	}
+
+	// a corrupted diff is reported as mismatched, also at block height 0
+	{
+		ContractStorageService corrupt_service(magic_num, "test_corrupt_leveldb.db", "test_corrupt_sql_db.db");
+		corrupt_service.save_contract_info(first_contract_info);
+		auto corrupted_commit = corrupt_service.commit_contract_changes(make_name_changes("", "c1"));
+		corrupt_service.commit_contract_changes(make_name_changes("c1", "c2"));
+		assert(corrupt_service.verify_history().ok() && corrupt_service.verify_history().verified_count == 3);
+		corrupt_service.close();
+		{
+			leveldb::DB* db = nullptr;
+			assert(leveldb::DB::Open(leveldb::Options(), "test_corrupt_leveldb.db", &db).ok());
+			std::string diff_str;
+			assert(db->Get(leveldb::ReadOptions(), corrupted_commit, &diff_str).ok());
+			// a well formed diff of other changes
+			assert(db->Put(leveldb::WriteOptions(), corrupted_commit, json_dumps(make_name_changes("", "c3")->to_json())).ok());
+			delete db;
+		}
+		corrupt_service.open();
+		const auto& corrupt_verify_result = corrupt_service.verify_history();
+		assert(!corrupt_verify_result.ok() && corrupt_verify_result.mismatched_commit_ids.size() == 1);
+		assert(corrupt_verify_result.mismatched_commit_ids[0] == corrupted_commit);
+		assert(corrupt_verify_result.verified_count == 2 && corrupt_verify_result.unverifiable_count == 0);
+	}
+
+	// event queries resume from continuation tokens and keep to the block heights
+	{
+		ContractStorageService events_service(magic_num, "test_events_leveldb.db", "test_events_sql_db.db");
+		events_service.save_contract_info(first_contract_info);
+		// the block height goes down to 2 again after block 3
+		std::vector<uint32_t> heights = { 1, 2, 3, 2 };
+		std::vector<std::string> all_args;
+		std::string last_name;
+		for (size_t i = 0; i < heights.size(); i++)
+		{
+			events_service.set_current_block_height(heights[i]);
+			const auto& name = "e" + std::to_string(i);
+			auto changes = make_name_changes(last_name, name);
+			for (size_t j = 0; j < 2; j++)
+			{
+				changes->events.push_back(ContractEventInfo{ "tx-events-" + name, contract_info->id, "renamed", name + "-" + std::to_string(j) });
+				all_args.push_back(changes->events.back().event_arg);
+			}
+			events_service.commit_contract_changes(changes);
+			last_name = name;
+		}
+		ContractEventFilter events_filter;
+		events_filter.contract_ids.insert(contract_info->id);
+		events_filter.limit = 3;
+		std::vector<std::string> resumed_args;
+		size_t queries_count = 0;
+		for (;;)
+		{
+			auto cursor = events_service.query_events(events_filter);
+			queries_count++;
+			for (; cursor->valid(); cursor->next())
+				resumed_args.push_back(cursor->entry().event.event_arg);
+			if (cursor->continuation().empty())
+				break;
+			events_filter.continuation = cursor->continuation();
+		}
+		assert(queries_count == 3 && resumed_args == all_args);
+
+		events_filter = ContractEventFilter();
+		events_filter.contract_ids.insert(contract_info->id);
+		events_filter.event_names.insert("renamed");
+		events_filter.from_block_height = 2;
+		events_filter.to_block_height = 2;
+		std::vector<std::string> height_args;
+		for (auto cursor = events_service.query_events(events_filter); cursor->valid(); cursor->next())
+			height_args.push_back(cursor->entry().event.event_arg);
+		assert((height_args == std::vector<std::string>{ "e1-0", "e1-1", "e3-0", "e3-1" }));
+	}
+
+	// event blooms are written with their commits, removed by rollbacks and never hide a matching event
+	{
+		ContractStorageService bloom_service(magic_num, "test_bloom_leveldb.db", "test_bloom_sql_db.db");
+		auto bloom_options = bloom_service.options();
+		bloom_options.event_bloom_range_blocks = 2;
+		bloom_service.set_options(bloom_options);
+		bloom_service.save_contract_info(first_contract_info);
+		// block ranges [0, 1], [2, 3] and [4, 5]
+		std::vector<uint32_t> heights = { 1, 2, 4 };
+		std::vector<std::string> event_names = { "renamed", "other", "renamed" };
+		std::vector<ContractCommitId> bloom_commits;
+		std::vector<ContractEventInfo> all_events;
+		std::string last_name;
+		for (size_t i = 0; i < heights.size(); i++)
+		{
+			bloom_service.set_current_block_height(heights[i]);
+			const auto& name = "b" + std::to_string(i);
+			auto changes = make_name_changes(last_name, name);
+			changes->events.push_back(ContractEventInfo{ "tx-bloom-" + name, contract_info->id, event_names[i], name });
+			changes->events.push_back(ContractEventInfo{ "tx-bloom-" + name, "c2", "renamed", name });
+			all_events.insert(all_events.end(), changes->events.begin(), changes->events.end());
+			bloom_commits.push_back(bloom_service.commit_contract_changes(changes));
+			last_name = name;
+		}
+		std::vector<uint64_t> bloom_seqs;
+		for (const auto& commit_id : bloom_commits)
+			bloom_seqs.push_back(bloom_service.get_commit_info(commit_id)->id);
+
+		// contract id and event name filters read through skip_unmatched, compared with all events
+		std::vector<AddressType> filter_contract_ids = { contract_info->id, "c2", "c3" };
+		std::vector<std::string> filter_event_names = { "renamed", "other", "missing" };
+		for (const auto& contract_id : filter_contract_ids)
+		{
+			for (const auto& event_name : filter_event_names)
+			{
+				ContractEventFilter bloom_filter;
+				bloom_filter.contract_ids.insert(contract_id);
+				bloom_filter.event_names.insert(event_name);
+				std::vector<std::string> found_args;
+				for (auto cursor = bloom_service.query_events(bloom_filter); cursor->valid(); cursor->next())
+					found_args.push_back(cursor->entry().event.event_arg);
+				std::vector<std::string> expected_args;
+				for (const auto& event : all_events)
+				{
+					if (event.contract_id == contract_id && event.event_name == event_name)
+						expected_args.push_back(event.event_arg);
+				}
+				assert(found_args == expected_args);
+			}
+		}
+
+		auto bloom_keys_exist = [&](const std::vector<std::string>& keys) {
+			bloom_service.close();
+			leveldb::DB* db = nullptr;
+			assert(leveldb::DB::Open(leveldb::Options(), "test_bloom_leveldb.db", &db).ok());
+			std::vector<bool> exist;
+			std::string value;
+			for (const auto& key : keys)
+				exist.push_back(db->Get(leveldb::ReadOptions(), key, &value).ok());
+			delete db;
+			bloom_service.open();
+			return exist;
+		};
+		std::vector<std::string> bloom_keys = {
+			ContractEventBloom::make_commit_key(bloom_seqs[0]),
+			ContractEventBloom::make_commit_key(bloom_seqs[1]),
+			ContractEventBloom::make_commit_key(bloom_seqs[2]),
+			ContractEventBloom::make_range_key(0),
+			ContractEventBloom::make_range_key(1)
+		};
+		assert((bloom_keys_exist(bloom_keys) == std::vector<bool>{ true, true, true, true, true }));
+		bloom_service.rollback_contract_state(bloom_commits[0]);
+		assert((bloom_keys_exist(bloom_keys) == std::vector<bool>{ true, false, false, false, false }));
+		ContractEventFilter rollbacked_filter;
+		rollbacked_filter.contract_ids.insert(contract_info->id);
+		rollbacked_filter.event_names.insert("renamed");
+		auto rollbacked_cursor = bloom_service.query_events(rollbacked_filter);
+		assert(rollbacked_cursor->valid() && rollbacked_cursor->entry().event.event_arg == "b0");
+		rollbacked_cursor->next();
+		assert(!rollbacked_cursor->valid());
+	}
+
+	// a failed batch drops only its own commits from the commit index
+	{
+		ContractStorageService failed_service(magic_num, "test_failed_leveldb.db", "test_failed_sql_db.db");
+		auto first_commit = failed_service.save_contract_info(first_contract_info);
+		auto make_balance_changes = [&](bool add, AmountType amount) {
+			auto changes = std::make_shared<ContractChanges>();
+			ContractBalanceChange balance_change;
+			balance_change.asset_id = 0;
+			balance_change.address = contract_info->id;
+			balance_change.amount = amount;
+			balance_change.add = add;
+			balance_change.is_contract = true;
+			changes->balance_changes.push_back(balance_change);
+			return changes;
+		};
+		auto balance_commit = failed_service.commit_contract_changes(make_balance_changes(true, 10));
+		bool batch_failed = false;
+		try
+		{
+			failed_service.commit_contract_changes_batch({ make_name_changes("", "f1"), make_balance_changes(false, 1000) });
+		}
+		catch (const ContractStorageException&)
+		{
+			batch_failed = true;
+		}
+		assert(batch_failed && failed_service.current_root_state_hash() == balance_commit && failed_service.top_commit_id() == balance_commit);
+		assert(failed_service.get_commit_info(first_commit) && failed_service.get_commit_info(balance_commit));
+		auto name_commit = failed_service.commit_contract_changes(make_name_changes("", "f1"));
+		assert(failed_service.top_commit_id() == name_commit && failed_service.get_commit_info(name_commit)->id == failed_service.get_commit_info(balance_commit)->id + 1);
+	}
+
+	// commits and rollbacks go on while the pruning thread deletes finalized history
+	{
+		ContractStorageService busy_service(magic_num, "test_busy_leveldb.db", "test_busy_sql_db.db");
+		auto busy_options = busy_service.options();
+		busy_options.sqlite.journal_mode = "WAL";
+		busy_options.keep_last_blocks = 2;
+		busy_options.prune_batch_commits = 1;
+		busy_options.prune_events = true;
+		busy_service.set_options(busy_options);
+		busy_service.save_contract_info(first_contract_info);
+		size_t failed_commits = 0;
+		std::string last_name;
+		for (uint32_t height = 1; height <= 300; height++)
+		{
+			busy_service.set_current_block_height(height);
+			const auto& name = "p" + std::to_string(height);
+			auto changes = make_name_changes(last_name, name);
+			changes->events.push_back(ContractEventInfo{ "tx-busy-" + name, contract_info->id, "renamed", name });
+			try
+			{
+				auto busy_commit = busy_service.commit_contract_changes(changes);
+				last_name = name;
+				// a rollback reads commit_info before it deletes
+				busy_service.commit_contract_changes(make_name_changes(name, name + "-undone"));
+				busy_service.rollback_contract_state(busy_commit);
+			}
+			catch (const ContractStorageException&)
+			{
+				failed_commits++;
+			}
+		}
+		assert(failed_commits == 0);
+		for (size_t i = 0; i < 1000 && busy_service.prune_stats().commits_pruned == 0; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		assert(busy_service.prune_stats().commits_pruned > 0);
+		assert(busy_service.get_contract_storage(contract_info->id, "name").as_string() == "p300");
+		assert(busy_service.verify_history().ok());
+	}
+
+	// overflow policies of subscriptions
+	{
+		auto make_notification = [](uint64_t commit_seq) {
+			auto notification = std::make_shared<ContractCommitNotification>();
+			notification->commit_seq = commit_seq;
+			return ContractCommitNotificationP(notification);
+		};
+		ContractCommitNotificationP popped;
+
+		ContractCommitSubscription drop_subscription(2, SUBSCRIBER_DROP_NOTIFICATION);
+		for (uint64_t seq = 1; seq <= 3; seq++)
+			drop_subscription.push(make_notification(seq));
+		assert(drop_subscription.dropped_count() == 1 && !drop_subscription.closed());
+		assert(drop_subscription.try_pop(popped) && popped->commit_seq == 1);
+		assert(drop_subscription.try_pop(popped) && popped->commit_seq == 2);
+		assert(!drop_subscription.try_pop(popped));
+
+		ContractCommitSubscription close_subscription(1, SUBSCRIBER_CLOSE);
+		close_subscription.push(make_notification(1));
+		close_subscription.push(make_notification(2));
+		assert(close_subscription.closed() && close_subscription.dropped_count() == 0);
+		assert(close_subscription.try_pop(popped) && popped->commit_seq == 1);
+		close_subscription.push(make_notification(3));
+		assert(!close_subscription.try_pop(popped));
+
+		// a blocked push goes on after a pop, or returns after close
+		ContractCommitSubscription block_subscription(1, SUBSCRIBER_BLOCK_COMMIT);
+		block_subscription.push(make_notification(1));
+		std::atomic<bool> pushed(false);
+		std::thread producer([&]() {
+			block_subscription.push(make_notification(2));
+			pushed.store(true);
+			block_subscription.push(make_notification(3));
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(!pushed.load());
+		assert(block_subscription.try_pop(popped) && popped->commit_seq == 1);
+		while (!pushed.load())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		block_subscription.close();
+		producer.join();
+		assert(block_subscription.try_pop(popped) && popped->commit_seq == 2);
+		assert(!block_subscription.try_pop(popped));
+	}
+
+	// finalized commits can't be rollbacked to, and their history is pruned
+	{
+		ContractStorageService prune_service(magic_num, "test_prune_leveldb.db", "test_prune_sql_db.db");
+		auto prune_options = prune_service.options();
+		prune_options.background_pruning = false;
+		prune_options.prune_events = true;
+		prune_service.set_options(prune_options);
+		std::vector<ContractCommitId> block_commits;
+		prune_service.set_current_block_height(1);
+		block_commits.push_back(prune_service.save_contract_info(contract_info));
+		std::string last_name;
+		for (uint32_t height = 2; height <= 5; height++)
+		{
+			prune_service.set_current_block_height(height);
+			const auto& name = "n" + std::to_string(height);
+			auto changes = make_name_changes(last_name, name);
+			changes->events.push_back(ContractEventInfo{ "tx-prune-" + std::to_string(height), contract_info->id, "renamed", name });
+			block_commits.push_back(prune_service.commit_contract_changes(changes));
+			last_name = name;
+		}
+		prune_service.finalize_before(block_commits[2]);
+		assert(prune_service.finalized_commit_id() == block_commits[2]);
+		bool rollback_finalized_failed = false;
+		try
+		{
+			prune_service.rollback_contract_state(block_commits[1]);
+		}
+		catch (const ContractStorageException&)
+		{
+			rollback_finalized_failed = true;
+		}
+		assert(rollback_finalized_failed && prune_service.current_root_state_hash() == block_commits[4]);
+		assert(prune_service.prune_history(100) == 2);
+		assert(prune_service.prune_stats().commits_pruned == 2 && prune_service.prune_stats().bytes_reclaimed > 0);
+		assert(prune_service.prune_history(100) == 0);
+		assert(!prune_service.get_commit_info(block_commits[1]));
+		assert(prune_service.get_transaction_events("tx-prune-2")->empty());
+		assert(prune_service.get_transaction_events("tx-prune-3")->size() == 1);
+		// the finalized commit itself can still be rollbacked to
+		prune_service.rollback_contract_state(block_commits[2]);
+		assert(prune_service.get_contract_storage(contract_info->id, "name").as_string() == "n3");
+
+		// keep_last_blocks finalizes the commits of older blocks on commit
+		prune_options.keep_last_blocks = 2;
+		prune_service.set_options(prune_options);
+		last_name = "n3";
+		ContractCommitId commit_at_4;
+		for (uint32_t height = 4; height <= 6; height++)
+		{
+			prune_service.set_current_block_height(height);
+			const auto& name = "m" + std::to_string(height);
+			auto commit_id = prune_service.commit_contract_changes(make_name_changes(last_name, name));
+			if (height == 4)
+				commit_at_4 = commit_id;
+			last_name = name;
+		}
+		assert(prune_service.finalized_commit_id() == commit_at_4);
+		auto bytes_reclaimed_before = prune_service.prune_stats().bytes_reclaimed;
+		assert(prune_service.prune_history(100) == 1);
+		assert(prune_service.prune_stats().commits_pruned == 3 && prune_service.prune_stats().bytes_reclaimed > bytes_reclaimed_before);
+		assert(prune_service.verify_history().ok());
+	}
+
 	{
 		std::string hello("hello world");
 		auto hello_base58 = fcrypto::to_base58(hello.c_str(), hello.size());
@@ -145,5 +674,38 @@ int main(int argc, char **argv)
 		assert(hello_str_decoded == hello);
 	}
 
+	// hash_many equals hash one by one with every backend, lanes get messages of mixed lengths
+	{
+		std::vector<uint32_t> message_sizes = { 0, 55, 56, 63, 64, 65, 119, 120, 128, 1000 };
+		for (size_t count : { (size_t)1, (size_t)3, (size_t)8, (size_t)13, (size_t)29 })
+		{
+			std::vector<std::string> messages;
+			for (size_t i = 0; i < count; i++)
+			{
+				std::string message(message_sizes[(i * 7) % message_sizes.size()], '\0');
+				for (size_t j = 0; j < message.size(); j++)
+					message[j] = (char)(i * 31 + j);
+				messages.push_back(message);
+			}
+			std::vector<const char*> datas;
+			std::vector<uint32_t> sizes;
+			for (const auto& message : messages)
+			{
+				datas.push_back(message.data());
+				sizes.push_back((uint32_t)message.size());
+			}
+			for (auto backend : { fcrypto::sha256_many_backend::automatic, fcrypto::sha256_many_backend::single, fcrypto::sha256_many_backend::avx2 })
+			{
+				if (!fcrypto::set_sha256_many_backend(backend))
+					continue;
+				std::vector<fcrypto::sha256> results(count);
+				fcrypto::sha256::hash_many(datas.data(), sizes.data(), count, results.data());
+				for (size_t i = 0; i < count; i++)
+					assert(results[i] == fcrypto::sha256::hash(datas[i], sizes[i]));
+			}
+			fcrypto::set_sha256_many_backend(fcrypto::sha256_many_backend::automatic);
+		}
+	}
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include <contract_storage/contract_storage.hpp>
+#include <chrono>
+#include <iostream>
+
+using namespace contract::storage;
+using namespace jsondiff;
+
+// rollback many commits changing the same hot contract, commit by commit vs coalesced
+static const size_t commits_count = 1000;
+
+static std::vector<ContractChangesP> make_hot_contract_changes(JsonDiff &differ, const AddressType& contract_id)
+{
+	std::vector<ContractChangesP> result;
+	for (size_t i = 0; i < commits_count; i++)
+	{
+		auto changes = std::make_shared<ContractChanges>();
+		ContractBalanceChange balance_change;
+		balance_change.add = true;
+		balance_change.is_contract = true;
+		balance_change.address = contract_id;
+		balance_change.amount = 1;
+		balance_change.asset_id = 0;
+		changes->balance_changes.push_back(balance_change);
+		ContractStorageChange storage_change;
+		storage_change.contract_id = contract_id;
+		ContractStorageItemChange item_change;
+		item_change.name = "counter";
+		item_change.diff = differ.diff(JsonValue(i == 0 ? std::string() : std::to_string(i)), JsonValue(std::to_string(i + 1)));
+		storage_change.items.push_back(item_change);
+		changes->storage_changes.push_back(storage_change);
+		result.push_back(changes);
+	}
+	return result;
+}
+
+static void commit_all(std::shared_ptr<ContractStorageService> service, const std::vector<ContractChangesP>& changes_list)
+{
+	for (size_t i = 0; i < changes_list.size(); i++)
+	{
+		service->set_current_block_height((uint32_t)(i + 1));
+		service->commit_contract_changes(changes_list[i]);
+	}
+}
+
+static void rollback_and_report(std::shared_ptr<ContractStorageService> service, const ContractCommitId& dest_commit_id, bool coalesce)
+{
+	auto options = service->options();
+	options.coalesce_rollback_writes = coalesce;
+	service->set_options(options);
+	auto start = std::chrono::steady_clock::now();
+	service->rollback_contract_state(dest_commit_id);
+	auto used_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	const auto& stats = service->last_rollback_stats();
+	std::cout << (coalesce ? "coalesced" : "commit by commit") << " rollback of " << stats.commits_count << " commits: "
+		<< used_ms << "ms, " << stats.keys_written << " keys written, " << stats.writes_saved() << " writes saved" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	// you need delete old test data to run this benchmark
+	JsonDiff differ;
+	auto service = ContractStorageService::get_instance(123, "bench_leveldb.db", "bench_sql_db.db");
+	service->open();
+	service->clear_sql_db();
+
+	auto contract_info = std::make_shared<ContractInfo>();
+	contract_info->id = "hot_contract";
+	contract_info->creator_address = "addr1";
+	contract_info->apis.push_back("init");
+	auto base_commit_id = service->save_contract_info(contract_info);
+	const auto& changes_list = make_hot_contract_changes(differ, contract_info->id);
+
+	commit_all(service, changes_list);
+	rollback_and_report(service, base_commit_id, false);
+	commit_all(service, changes_list);
+	rollback_and_report(service, base_commit_id, true);
+	return 0;
+}
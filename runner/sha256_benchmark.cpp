@@ -0,0 +1,75 @@
+#include <fcrypto/sha256.hpp>
+#include <fcrypto/sha_backend.hpp>
+#include <chrono>
+#include <iostream>
+#include <cassert>
+
+using namespace fcrypto;
+
+// hash many small messages one by one vs sha256::hash_many, with every sha backend
+static const size_t messages_count = 1 << 17;
+static const size_t rounds = 5;
+
+static std::vector<std::string> make_messages(size_t message_size)
+{
+	std::vector<std::string> messages;
+	for (size_t i = 0; i < messages_count; i++)
+	{
+		std::string message(message_size, 'k');
+		for (size_t j = 0; j < message_size && j < sizeof(i); j++)
+			message[j] = (char)(i >> (8 * j));
+		messages.push_back(message);
+	}
+	return messages;
+}
+
+static double megabytes_per_second(size_t bytes, std::chrono::steady_clock::duration used)
+{
+	auto used_us = std::chrono::duration_cast<std::chrono::microseconds>(used).count();
+	return used_us > 0 ? (double)bytes / used_us : 0;
+}
+
+static void benchmark_message_size(size_t message_size)
+{
+	const auto& messages = make_messages(message_size);
+	std::vector<sha256> single_results(messages.size());
+	std::vector<sha256> many_results;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++)
+	{
+		for (size_t i = 0; i < messages.size(); i++)
+			single_results[i] = sha256::hash(messages[i].data(), (uint32_t)messages[i].size());
+	}
+	auto single_used = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round++)
+		many_results = sha256::hash_many(messages);
+	auto many_used = std::chrono::steady_clock::now() - start;
+
+	assert(single_results == many_results);
+	auto bytes = rounds * messages.size() * message_size;
+	std::cout << messages.size() << " messages of " << message_size << " bytes: single "
+		<< megabytes_per_second(bytes, single_used) << "MB/s, hash_many " << megabytes_per_second(bytes, many_used) << "MB/s" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	auto default_backend = current_sha_backend();
+	for (auto backend : { sha_backend::openssl, sha_backend::sha_ni })
+	{
+		if (!set_sha_backend(backend))
+		{
+			std::cout << sha_backend_name(backend) << " backend not supported by this cpu" << std::endl;
+			continue;
+		}
+		std::cout << sha_backend_name(backend) << " backend" << (backend == default_backend ? "(default)" : "") << ":" << std::endl;
+		benchmark_message_size(32);
+		benchmark_message_size(64);
+		benchmark_message_size(200);
+		benchmark_message_size(1024);
+	}
+	set_sha_backend(default_backend);
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <contract_storage/contract_storage.hpp>
+#include <contract_storage/config.hpp>
+#include <chrono>
+#include <iostream>
+
+using namespace contract::storage;
+using namespace jsondiff;
+
+// commits per second of the same commits under each sqlite durability profile
+static const size_t commits_count = 1000;
+
+static ContractChangesP make_counter_changes(JsonDiff &differ, const AddressType& contract_id, size_t i)
+{
+	auto changes = std::make_shared<ContractChanges>();
+	ContractBalanceChange balance_change;
+	balance_change.add = true;
+	balance_change.is_contract = true;
+	balance_change.address = contract_id;
+	balance_change.amount = 1;
+	balance_change.asset_id = 0;
+	changes->balance_changes.push_back(balance_change);
+	ContractStorageChange storage_change;
+	storage_change.contract_id = contract_id;
+	ContractStorageItemChange item_change;
+	item_change.name = "counter";
+	item_change.diff = differ.diff(JsonValue(i == 0 ? std::string() : std::to_string(i)), JsonValue(std::to_string(i + 1)));
+	storage_change.items.push_back(item_change);
+	changes->storage_changes.push_back(storage_change);
+	return changes;
+}
+
+static void run_profile(const std::string& name, const ContractSqliteOptions& sqlite_options)
+{
+	JsonDiff differ;
+	ContractStorageService service(123, "bench_" + name + "_leveldb.db", "bench_" + name + "_sql_db.db", false);
+	auto options = service.options();
+	options.sqlite = sqlite_options;
+	service.set_options(options);
+	service.open();
+	service.clear_sql_db();
+
+	auto contract_info = std::make_shared<ContractInfo>();
+	contract_info->id = "counter_contract";
+	contract_info->creator_address = "addr1";
+	contract_info->apis.push_back("init");
+	service.save_contract_info(contract_info);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < commits_count; i++)
+	{
+		service.set_current_block_height((uint32_t)(i + 1));
+		service.commit_contract_changes(make_counter_changes(differ, contract_info->id, i));
+	}
+	auto used_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << name << " (journal_mode=" << sqlite_options.journal_mode << ", synchronous=" << sqlite_options.synchronous << "): "
+		<< commits_count << " commits in " << used_ms << "ms, " << (used_ms > 0 ? commits_count * 1000 / used_ms : commits_count) << " commits/s" << std::endl;
+	service.close();
+}
+
+int main(int argc, char **argv)
+{
+	// you need delete old test data to run this benchmark
+	auto wal_full = ContractSqliteOptions::durable();
+	wal_full.journal_mode = "WAL";
+	run_profile("durable", ContractSqliteOptions::durable());
+	run_profile("wal_full", wal_full);
+	run_profile("fast", ContractSqliteOptions::fast());
+	return 0;
+}
@@ -0,0 +1,33 @@
+#include <contract_storage/contract_storage.hpp>
+#include <chrono>
+#include <iostream>
+
+using namespace contract::storage;
+
+// recompute all commit ids of a storage db
+// usage: verify_history <leveldb path> <sqlite db path> [threads]
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage: " << argv[0] << " <leveldb path> <sqlite db path> [threads]" << std::endl;
+		return 2;
+	}
+	ContractStorageService service(0, argv[1], argv[2], false);
+	auto options = service.options();
+	if (argc > 3)
+		options.state_scan_threads = (size_t)std::stoul(argv[3]);
+	// only reading history
+	options.background_pruning = false;
+	service.set_options(options);
+	service.open();
+
+	auto start = std::chrono::steady_clock::now();
+	const auto& result = service.verify_history();
+	auto used_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << result.commits_count << " commits in " << used_ms << "ms: " << result.verified_count << " verified, "
+		<< result.unverifiable_count << " unverifiable, " << result.mismatched_commit_ids.size() << " mismatched" << std::endl;
+	for (const auto& commit_id : result.mismatched_commit_ids)
+		std::cout << "mismatched commit " << commit_id << std::endl;
+	return result.ok() ? 0 : 1;
+}